@@ -1,3 +1,14 @@
+/*
+** mremap and syscall are declared only for GNU sources, and robust
+** mutexes only from POSIX.1-2008 on.
+*/
+#if (defined (TLSF_MMAP) || defined (TLSF_LOCK) || defined (TLSF_SHARED)) \
+	&& defined (__linux__) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#elif defined (TLSF_SHARED) && !defined (__linux__) && !defined (_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <assert.h>
 #include <limits.h>
 #include <stddef.h>
@@ -6,6 +17,35 @@
 #include <string.h>
 
 #include "tlsf.h"
+#include "tlsf_inline.h"
+
+#if defined (TLSF_SHARED)
+#include <errno.h>
+#include <pthread.h>
+#endif
+
+#if defined (TLSF_LOCK) || defined (TLSF_STATS) || defined (TLSF_PROFILE)
+#include <time.h>
+#endif
+
+#if defined (TLSF_MMAP)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if defined (TLSF_USDT)
+#include <sys/sdt.h>
+#endif
+
+#if defined (TLSF_LOCK)
+#if defined (__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <sched.h>
+#endif
+#endif
 
 #if defined(__cplusplus)
 #define tlsf_decl inline
@@ -206,9 +246,37 @@ enum tlsf_public
 {
 	/* log2 of number of linear subdivisions of block sizes. Larger
 	** values require more memory in the control structure. Values of
-	** 4 or 5 are typical.
+	** 4 or 5 are typical; set TLSF_SL_INDEX_COUNT_LOG2, see tlsf.h.
 	*/
-	SL_INDEX_COUNT_LOG2 = 5,
+	SL_INDEX_COUNT_LOG2 = TLSF_SL_INDEX_COUNT_LOG2,
+
+	/* With TLSF_DEFER_COALESCE, frees of blocks in the first
+	** DEFER_FL_COUNT first-level classes are deferred, and at most
+	** DEFER_LIMIT blocks may be pending at once. The limit bounds the
+	** work done when the pending blocks are coalesced.
+	*/
+	DEFER_FL_COUNT = 4,
+	DEFER_LIMIT = 256,
+
+	/* Free blocks tlsf_memalign inspects for an exactly sized aligned
+	** fit before falling back to over-allocating by the alignment.
+	*/
+	ALIGN_PROBE_LIMIT = 16,
+
+	/* Alignment and size granularity of TLSF_MALLOC_ISOLATE blocks;
+	** set to the target's cache line size.
+	*/
+	CACHE_LINE_SIZE = 64,
+
+	/* With TLSF_MMAP, requests of at least this many bytes are mapped
+	** directly unless tlsf_set_mmap_threshold says otherwise.
+	*/
+	MMAP_THRESHOLD = 32 * 1024 * 1024,
+
+	/* With TLSF_REGISTRY, address ranges the process can register; each
+	** pool takes one, and a pool lying inside another takes two more.
+	*/
+	REGISTRY_MAX = 1024,
 };
 
 /* Private constants: do not modify. */
@@ -248,6 +316,9 @@ enum tlsf_private
 	FL_INDEX_COUNT = (FL_INDEX_MAX - FL_INDEX_SHIFT + 1),
 
 	SMALL_BLOCK_SIZE = (1 << FL_INDEX_SHIFT),
+
+	/* With TLSF_POOL_LISTS, each pool of a heap is tracked by one bit. */
+	POOL_COUNT_MAX = 32,
 };
 
 /*
@@ -282,9 +353,20 @@ tlsf_static_assert(sizeof(size_t) * CHAR_BIT <= 64);
 /* SL_INDEX_COUNT must be <= number of bits in sl_bitmap's storage type. */
 tlsf_static_assert(sizeof(unsigned int) * CHAR_BIT >= SL_INDEX_COUNT);
 
+/*
+** Searches then round up by at most an eighth, which the pools grown by
+** child heaps and tlsf_preload.c allow for.
+*/
+tlsf_static_assert(SL_INDEX_COUNT_LOG2 >= 3);
+
 /* Ensure we've properly tuned our sizes. */
 tlsf_static_assert(ALIGN_SIZE == SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
 
+/* The compile-time size classes of tlsf_inline.h must match ours. */
+tlsf_static_assert(TLSF_CLASS_ALIGN_LOG2 == ALIGN_SIZE_LOG2);
+tlsf_static_assert(TLSF_CLASS_SL_LOG2 == SL_INDEX_COUNT_LOG2);
+tlsf_static_assert(TLSF_CLASS_SMALL == SMALL_BLOCK_SIZE);
+
 /*
 ** Data structures and associated constants.
 */
@@ -321,6 +403,39 @@ typedef struct block_header_t
 static const size_t block_header_free_bit = 1 << 0;
 static const size_t block_header_prev_free_bit = 1 << 1;
 
+/*
+** With TLSF_TAGS, the top bits of the size field, which no block size
+** reaches on 64-bit builds, hold the tag of a used block.
+*/
+#if defined (TLSF_TAGS)
+#if !defined (TLSF_64BIT)
+#error TLSF_TAGS requires a 64-bit build.
+#endif
+static const int block_header_tag_shift = 56;
+static const size_t block_header_tag_bits = tlsf_cast(size_t, TLSF_TAG_COUNT - 1) << 56;
+tlsf_static_assert(FL_INDEX_MAX < 56);
+tlsf_static_assert(TLSF_TAG_COUNT == 256);
+#else
+static const size_t block_header_tag_bits = 0;
+#endif
+
+/*
+** With TLSF_DEFER_COALESCE, a block whose free was deferred stays used
+** but carries one more status bit, so a pool rebuilt from its block chain
+** can free it. Sizes on 64-bit builds are multiples of 8, leaving bit 2
+** clear; 32-bit pools end below 2^(FL_INDEX_MAX + 1), and mapped blocks
+** are kept below it too.
+*/
+#if defined (TLSF_DEFER_COALESCE)
+#if defined (TLSF_64BIT)
+static const size_t block_header_deferred_bit = 1 << 2;
+#else
+static const size_t block_header_deferred_bit = tlsf_cast(size_t, 1) << (FL_INDEX_MAX + 1);
+#endif
+#else
+static const size_t block_header_deferred_bit = 0;
+#endif
+
 /*
 ** The size of the block header exposed to used blocks is the size field.
 ** The prev_phys_block field is stored *inside* the previous free block.
@@ -340,9 +455,315 @@ static const size_t block_size_min =
 	sizeof(block_header_t) - sizeof(block_header_t*);
 static const size_t block_size_max = tlsf_cast(size_t, 1) << FL_INDEX_MAX;
 
+#if defined (TLSF_LOCK) || defined (TLSF_STATS) || defined (TLSF_PROFILE)
+/*
+** Timestamps for latency measurement. The time stamp counter is used
+** where it can be read directly; elsewhere, a monotonic clock in
+** nanoseconds. Either way, values are only meaningful as differences.
+*/
+#if defined (__GNUC__) && (defined (__i386__) || defined (__x86_64__))
+static unsigned long long tlsf_ticks(void)
+{
+	unsigned int lo, hi;
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return (tlsf_cast(unsigned long long, hi) << 32) | lo;
+}
+#else
+static unsigned long long tlsf_ticks(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return tlsf_cast(unsigned long long, ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+/*
+** Log-linear histograms: values below 4 get a bucket each, after which
+** every power of two is split into 4 linear sub-buckets. The last bucket
+** collects everything beyond its lower bound.
+*/
+static int histogram_bucket(unsigned long long value)
+{
+	const unsigned int high = tlsf_cast(unsigned int, value >> 32);
+	const int bit = high ? 32 + tlsf_fls(high) : tlsf_fls(tlsf_cast(unsigned int, value));
+	int bucket;
+
+	if (bit < 2)
+	{
+		return tlsf_cast(int, value);
+	}
+	bucket = (bit - 1) * 4 + tlsf_cast(int, (value >> (bit - 2)) & 3);
+	return tlsf_min(bucket, TLSF_HISTOGRAM_BUCKETS - 1);
+}
+#endif
 
-/* The TLSF control structure. */
-typedef struct control_t
+#if defined (TLSF_STATS) || defined (TLSF_PROFILE)
+/*
+** Statistics and profiles read tlsf_ticks unless another counter has been
+** installed with tlsf_set_counter, for example one backed by
+** perf_event_open to count instructions or cache misses instead.
+*/
+static tlsf_counter counter_source;
+static void* counter_user;
+
+static unsigned long long counter_read(void)
+{
+	return counter_source ? counter_source(counter_user) : tlsf_ticks();
+}
+#endif
+
+#if defined (TLSF_LOCK) || defined (TLSF_PROFILE)
+/* For histograms only written with the heap lock held. */
+static void histogram_add(tlsf_histogram_t* histogram, unsigned long long value)
+{
+	histogram->count++;
+	histogram->total += value;
+	histogram->max = tlsf_max(histogram->max, value);
+	histogram->bucket[histogram_bucket(value)]++;
+}
+#endif
+
+#if defined (TLSF_STATS)
+/*
+** Operation statistics.
+**
+** Latencies are taken around each public entry point, including any time
+** spent waiting for the built-in lock, and recorded with relaxed atomic
+** updates so that instrumented heaps need no extra locking. Without
+** TLSF_STATS the macros below compile to nothing.
+*/
+#if defined (__GNUC__)
+#define stats_add(counter, value) \
+	__atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define stats_load(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define stats_add(counter, value) ((counter) += (value))
+#define stats_load(counter) (counter)
+#endif
+
+static void stats_latency(tlsf_stats_t* stats, int op, unsigned long long start)
+{
+	const unsigned long long value = counter_read() - start;
+	tlsf_histogram_t* histogram = &stats->latency[op];
+	unsigned long long max = stats_load(histogram->max);
+
+	stats_add(histogram->count, 1);
+	stats_add(histogram->total, value);
+	stats_add(histogram->bucket[histogram_bucket(value)], 1);
+#if defined (__GNUC__)
+	while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value,
+		1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+	}
+#else
+	histogram->max = tlsf_max(max, value);
+#endif
+}
+
+#define stats_now() counter_read()
+#define stats_record(control, op, start) stats_latency(&(control)->stats, (op), (start))
+#define stats_count(control, counter) stats_add((control)->stats.counter, 1)
+#else
+#define stats_now() 0
+#define stats_record(control, op, start) ((void)(start))
+#define stats_count(control, counter) ((void)0)
+#endif
+
+/*
+** Internal operation profiles. With TLSF_PROFILE, the free-list search,
+** block splits and merges, and free-list insertions and removals are each
+** measured with the installed counter. Times are inclusive: a merge also
+** counts the removal it performs. Profiles are written with the lock held.
+*/
+#if defined (TLSF_PROFILE)
+#define profile_now() counter_read()
+#define profile_record(control, op, start) \
+	histogram_add(&(control)->profile.ops[op], counter_read() - (start))
+#else
+#define profile_now() 0
+#define profile_record(control, op, start) ((void)(start))
+#endif
+
+/*
+** Tracing. With TLSF_USDT, allocator events are USDT probes of provider
+** tlsf, for bpftrace, perf or SystemTap to attach to; with TLSF_HOOKS,
+** they call the table installed by tlsf_set_hooks. Unlike uprobes on
+** internal functions, these survive inlining. Without either flag the
+** macros below compile to nothing.
+*/
+#if defined (TLSF_USDT)
+#define usdt_probe2(name, a, b) DTRACE_PROBE2(tlsf, name, a, b)
+#define usdt_probe3(name, a, b, c) DTRACE_PROBE3(tlsf, name, a, b, c)
+#define usdt_probe4(name, a, b, c, d) DTRACE_PROBE4(tlsf, name, a, b, c, d)
+#else
+#define usdt_probe2(name, a, b) ((void)0)
+#define usdt_probe3(name, a, b, c) ((void)0)
+#define usdt_probe4(name, a, b, c, d) ((void)0)
+#endif
+
+#if defined (TLSF_HOOKS)
+static const tlsf_hooks_t* hooks_table;
+static void* hooks_user;
+
+#define hook_call(hook, args) \
+	((hooks_table && hooks_table->hook) ? hooks_table->hook args : (void)0)
+#else
+#define hook_call(hook, args) ((void)0)
+#endif
+
+#if defined (TLSF_USDT) || defined (TLSF_HOOKS)
+#define trace_split(block, remaining) \
+	do \
+	{ \
+		usdt_probe3(split, tlsf_cast(void*, block), block_size(block), block_size(remaining)); \
+		hook_call(on_split, (hooks_user, tlsf_cast(void*, block), block_size(block), block_size(remaining))); \
+	} while (0)
+#define trace_merge(block) \
+	do \
+	{ \
+		usdt_probe2(merge, tlsf_cast(void*, block), block_size(block)); \
+		hook_call(on_merge, (hooks_user, tlsf_cast(void*, block), block_size(block))); \
+	} while (0)
+#define trace_pool_add(control, pool, bytes) \
+	do \
+	{ \
+		usdt_probe3(pool_add, tlsf_cast(void*, control), tlsf_cast(void*, pool), (bytes)); \
+		hook_call(on_pool_add, (hooks_user, tlsf_cast(tlsf_t, control), tlsf_cast(pool_t, pool), (bytes))); \
+	} while (0)
+#define trace_pool_remove(control, pool) \
+	do \
+	{ \
+		usdt_probe2(pool_remove, tlsf_cast(void*, control), tlsf_cast(void*, pool)); \
+		hook_call(on_pool_remove, (hooks_user, tlsf_cast(tlsf_t, control), tlsf_cast(pool_t, pool))); \
+	} while (0)
+#else
+#define trace_split(block, remaining) ((void)0)
+#define trace_merge(block) ((void)0)
+#define trace_pool_add(control, pool, bytes) ((void)0)
+#define trace_pool_remove(control, pool) ((void)0)
+#endif
+
+#if defined (TLSF_LOCK)
+/*
+** Adaptive lock.
+**
+** TLSF critical sections are short and bounded, so a waiter first spins
+** for roughly the length of one operation before going to sleep. The
+** lock word follows the usual futex protocol: 0 is unlocked, 1 is locked
+** and 2 is locked with (possible) sleepers, so an uncontended release
+** never enters the kernel. Statistics are only written while the lock is
+** held and need no further synchronization.
+*/
+#if !defined (__GNUC__)
+#error TLSF_LOCK requires GCC-compatible atomic builtins.
+#endif
+
+#if defined (__linux__)
+static void lock_sleep(int* word)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, 2, 0, 0, 0);
+}
+
+static void lock_wake(int* word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+}
+#else
+static void lock_sleep(int* word)
+{
+	(void)word;
+	sched_yield();
+}
+
+static void lock_wake(int* word)
+{
+	(void)word;
+}
+#endif
+
+#if defined (__i386__) || defined (__x86_64__)
+#define lock_relax() __builtin_ia32_pause()
+#else
+#define lock_relax() ((void)0)
+#endif
+
+enum tlsf_lock_private
+{
+	/* Spin iterations before sleeping; about one malloc/free worth. */
+	LOCK_SPIN_COUNT = 128,
+};
+
+typedef struct lock_t
+{
+	int word;
+	unsigned long long acquired_at;
+	tlsf_lock_stats_t stats;
+} lock_t;
+
+static void lock_acquire(lock_t* lock)
+{
+	int expected = 0;
+	unsigned long long start;
+	int spin;
+
+	if (__atomic_compare_exchange_n(&lock->word, &expected, 1, 0,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		lock->acquired_at = tlsf_ticks();
+		lock->stats.acquisitions++;
+		return;
+	}
+
+	start = tlsf_ticks();
+	for (spin = 0; spin < LOCK_SPIN_COUNT; ++spin)
+	{
+		lock_relax();
+		expected = 0;
+		if (__atomic_load_n(&lock->word, __ATOMIC_RELAXED) == 0
+			&& __atomic_compare_exchange_n(&lock->word, &expected, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+
+	if (spin == LOCK_SPIN_COUNT)
+	{
+		/* Mark the lock contended, and sleep until it is released. */
+		while (__atomic_exchange_n(&lock->word, 2, __ATOMIC_ACQUIRE) != 0)
+		{
+			lock->stats.sleeps++;
+			lock_sleep(&lock->word);
+		}
+	}
+
+	lock->acquired_at = tlsf_ticks();
+	lock->stats.acquisitions++;
+	lock->stats.contended++;
+	histogram_add(&lock->stats.wait, lock->acquired_at - start);
+}
+
+static void lock_release(lock_t* lock)
+{
+	histogram_add(&lock->stats.hold, tlsf_ticks() - lock->acquired_at);
+	if (__atomic_exchange_n(&lock->word, 0, __ATOMIC_RELEASE) == 2)
+	{
+		lock_wake(&lock->word);
+	}
+}
+
+#define control_lock(control) lock_acquire(&(control)->lock)
+#define control_unlock(control) lock_release(&(control)->lock)
+#else
+#define control_lock(control) ((void)(control))
+#define control_unlock(control) ((void)(control))
+#endif
+
+/*
+** The free lists. A heap holds one set shared by all of its pools, or
+** with TLSF_POOL_LISTS, each pool starts with a set of its own.
+*/
+typedef struct lists_t
 {
 	/* Empty lists point at this block to indicate they are free. */
 	block_header_t block_null;
@@ -353,8 +774,119 @@ typedef struct control_t
 
 	/* Head of free lists. */
 	block_header_t* blocks[FL_INDEX_COUNT][SL_INDEX_COUNT];
+
+#if defined (TLSF_PRIO)
+	/* Bytes in free blocks, counting those whose free was deferred. */
+	size_t free_bytes;
+#endif
+
+#if defined (TLSF_DEFER_COALESCE)
+	/* Freed blocks awaiting coalescing, by size class. */
+	unsigned int deferred_count;
+	unsigned int deferred_bitmap[DEFER_FL_COUNT];
+	block_header_t* deferred[DEFER_FL_COUNT][SL_INDEX_COUNT];
+#endif
+
+#if defined (TLSF_POOL_LISTS)
+	/* The heap of the pool, which keeps the statistics and profiles. */
+	struct control_t* heap;
+
+	/*
+	** The pool's slot, the address of its sentinel block, and the
+	** first-level bitmap last published to the heap, which is left empty
+	** while the pool drains. Bytes in used blocks are counted as well.
+	*/
+	int pool_slot;
+	void* pool_end;
+	unsigned int pool_published;
+	int pool_draining;
+	size_t pool_used;
+
+#if defined (TLSF_PRIO)
+	/* The free bytes last published to the heap, none while draining. */
+	size_t pool_free_published;
+#endif
+#endif
+} lists_t;
+
+/* The TLSF control structure. */
+typedef struct control_t
+{
+#if !defined (TLSF_POOL_LISTS)
+	/* The free lists come first, so a heap is found from its lists. */
+	lists_t lists;
+#endif
+
+#if defined (TLSF_PRIO)
+	/* Free bytes each priority must leave, and allocations it was denied. */
+	size_t prio_watermark[TLSF_PRIO_COUNT];
+	unsigned long long prio_denied[TLSF_PRIO_COUNT];
+#endif
+
+#if defined (TLSF_LOCK)
+	lock_t lock;
+#endif
+
+#if defined (TLSF_STATS)
+	tlsf_stats_t stats;
+#endif
+
+#if defined (TLSF_PROFILE)
+	tlsf_profile_t profile;
+#endif
+
+#if defined (TLSF_TAGS)
+	/* Live bytes and blocks by tag. */
+	tlsf_tag_stats_t tags[TLSF_TAG_COUNT];
+#endif
+
+#if defined (TLSF_MMAP)
+	/* Requests of at least this size are mapped directly; 0 disables. */
+	size_t mmap_threshold;
+#endif
+
+#if defined (TLSF_POOL_LISTS)
+	/*
+	** Pools by slot and by address, the pools with free blocks at each
+	** first-level index, and the indices where any pool has one.
+	*/
+	int pool_count;
+	unsigned int pool_fl_bitmap;
+	unsigned int pool_fl_map[FL_INDEX_COUNT];
+	lists_t* pool_slots[POOL_COUNT_MAX];
+	lists_t* pool_sorted[POOL_COUNT_MAX];
+
+	/* The drained-pool handler and a drain awaiting it. */
+	tlsf_pool_handler pool_drained_handler;
+	void* pool_drained_user;
+	lists_t* pool_drained;
+
+#if defined (TLSF_PRIO)
+	/* The free bytes of the pools. */
+	size_t pool_free;
+#endif
+#endif
 } control_t;
 
+/* The heap whose statistics and profiles an operation on lists counts in. */
+#if defined (TLSF_POOL_LISTS)
+#define lists_heap(lists) ((lists)->heap)
+#else
+#define lists_heap(lists) tlsf_cast(control_t*, lists)
+#endif
+
+/*
+** Free bytes are counted as blocks enter and leave the free and deferred
+** lists, for the priority watermarks.
+*/
+#if defined (TLSF_PRIO)
+#define free_bytes_add(lists, size) ((lists)->free_bytes += (size))
+#define free_bytes_sub(lists, size) ((lists)->free_bytes -= (size))
+#else
+#define free_bytes_add(lists, size) ((void)0)
+#define free_bytes_sub(lists, size) ((void)0)
+#endif
+
 /* A type used for casting when doing pointer arithmetic. */
 typedef ptrdiff_t tlsfptr_t;
 
@@ -364,13 +896,15 @@ typedef ptrdiff_t tlsfptr_t;
 
 static size_t block_size(const block_header_t* block)
 {
-	return block->size & ~(block_header_free_bit | block_header_prev_free_bit);
+	return block->size & ~(block_header_free_bit | block_header_prev_free_bit
+		| block_header_deferred_bit | block_header_tag_bits);
 }
 
 static void block_set_size(block_header_t* block, size_t size)
 {
 	const size_t oldsize = block->size;
-	block->size = size | (oldsize & (block_header_free_bit | block_header_prev_free_bit));
+	block->size = size | (oldsize & (block_header_free_bit | block_header_prev_free_bit
+		| block_header_deferred_bit | block_header_tag_bits));
 }
 
 static int block_is_last(const block_header_t* block)
@@ -492,7 +1026,9 @@ static void* align_ptr(const void* ptr, size_t align)
 static size_t adjust_request_size(size_t size, size_t align)
 {
 	size_t adjust = 0;
-	if (size)
+
+	/* Sizes within align of the top of the range would wrap when aligned. */
+	if (size && size < block_size_max)
 	{
 		const size_t aligned = align_up(size, align);
 
@@ -540,7 +1076,21 @@ static void mapping_search(size_t size, int* fli, int* sli)
 	mapping_insert(size, fli, sli);
 }
 
-static block_header_t* search_suitable_block(control_t* control, int* fli, int* sli)
+#if !defined (TLSF_POOL_LISTS)
+/*
+** The smallest block size filed under class fl/sl; mapping_search never
+** picks a class below the size it was given.
+*/
+static size_t mapping_size(int fl, int sl)
+{
+	const int shift = fl + FL_INDEX_SHIFT - 1;
+	return fl
+		? (tlsf_cast(size_t, 1) << shift) + (tlsf_cast(size_t, sl) << (shift - SL_INDEX_COUNT_LOG2))
+		: tlsf_cast(size_t, sl) << ALIGN_SIZE_LOG2;
+}
+#endif
+
+static block_header_t* search_suitable_block(lists_t* lists, int* fli, int* sli)
 {
 	int fl = *fli;
 	int sl = *sli;
@@ -549,11 +1099,11 @@ static block_header_t* search_suitable_block(control_t* control, int* fli, int*
 	** First, search for a block in the list associated with the given
 	** fl/sl index.
 	*/
-	unsigned int sl_map = control->sl_bitmap[fl] & (~0U << sl);
+	unsigned int sl_map = lists->sl_bitmap[fl] & (~0U << sl);
 	if (!sl_map)
 	{
 		/* No block exists. Search in the next largest first-level list. */
-		const unsigned int fl_map = control->fl_bitmap & (~0U << (fl + 1));
+		const unsigned int fl_map = lists->fl_bitmap & (~0U << (fl + 1));
 		if (!fl_map)
 		{
 			/* No free blocks available, memory has been exhausted. */
@@ -562,18 +1112,18 @@ static block_header_t* search_suitable_block(control_t* control, int* fli, int*
 
 		fl = tlsf_ffs(fl_map);
 		*fli = fl;
-		sl_map = control->sl_bitmap[fl];
+		sl_map = lists->sl_bitmap[fl];
 	}
 	tlsf_assert(sl_map && "internal error - second level bitmap is null");
 	sl = tlsf_ffs(sl_map);
 	*sli = sl;
 
 	/* Return the first block in the free list. */
-	return control->blocks[fl][sl];
+	return lists->blocks[fl][sl];
 }
 
 /* Remove a free block from the free list.*/
-static void remove_free_block(control_t* control, block_header_t* block, int fl, int sl)
+static void remove_free_block(lists_t* lists, block_header_t* block, int fl, int sl)
 {
 	block_header_t* prev = block->prev_free;
 	block_header_t* next = block->next_free;
@@ -581,34 +1131,35 @@ static void remove_free_block(control_t* control, block_header_t* block, int fl,
 	tlsf_assert(next && "next_free field can not be null");
 	next->prev_free = prev;
 	prev->next_free = next;
+	free_bytes_sub(lists, block_size(block));
 
 	/* If this block is the head of the free list, set new head. */
-	if (control->blocks[fl][sl] == block)
+	if (lists->blocks[fl][sl] == block)
 	{
-		control->blocks[fl][sl] = next;
+		lists->blocks[fl][sl] = next;
 
 		/* If the new head is null, clear the bitmap. */
-		if (next == &control->block_null)
+		if (next == &lists->block_null)
 		{
-			control->sl_bitmap[fl] &= ~(1U << sl);
+			lists->sl_bitmap[fl] &= ~(1U << sl);
 
 			/* If the second bitmap is now empty, clear the fl bitmap. */
-			if (!control->sl_bitmap[fl])
+			if (!lists->sl_bitmap[fl])
 			{
-				control->fl_bitmap &= ~(1U << fl);
+				lists->fl_bitmap &= ~(1U << fl);
 			}
 		}
 	}
 }
 
 /* Insert a free block into the free block list. */
-static void insert_free_block(control_t* control, block_header_t* block, int fl, int sl)
+static void insert_free_block(lists_t* lists, block_header_t* block, int fl, int sl)
 {
-	block_header_t* current = control->blocks[fl][sl];
+	block_header_t* current = lists->blocks[fl][sl];
 	tlsf_assert(current && "free list cannot have a null entry");
 	tlsf_assert(block && "cannot insert a null entry into the free list");
 	block->next_free = current;
-	block->prev_free = &control->block_null;
+	block->prev_free = &lists->block_null;
 	current->prev_free = block;
 
 	tlsf_assert(block_to_ptr(block) == align_ptr(block_to_ptr(block), ALIGN_SIZE)
@@ -617,25 +1168,30 @@ static void insert_free_block(control_t* control, block_header_t* block, int fl,
 	** Insert the new block at the head of the list, and mark the first-
 	** and second-level bitmaps appropriately.
 	*/
-	control->blocks[fl][sl] = block;
-	control->fl_bitmap |= (1U << fl);
-	control->sl_bitmap[fl] |= (1U << sl);
+	lists->blocks[fl][sl] = block;
+	lists->fl_bitmap |= (1U << fl);
+	lists->sl_bitmap[fl] |= (1U << sl);
+	free_bytes_add(lists, block_size(block));
 }
 
 /* Remove a given block from the free list. */
-static void block_remove(control_t* control, block_header_t* block)
+static void block_remove(lists_t* lists, block_header_t* block)
 {
+	const unsigned long long start = profile_now();
 	int fl, sl;
 	mapping_insert(block_size(block), &fl, &sl);
-	remove_free_block(control, block, fl, sl);
+	remove_free_block(lists, block, fl, sl);
+	profile_record(lists_heap(lists), TLSF_PROFILE_REMOVE, start);
 }
 
 /* Insert a given block into the free list. */
-static void block_insert(control_t* control, block_header_t* block)
+static void block_insert(lists_t* lists, block_header_t* block)
 {
+	const unsigned long long start = profile_now();
 	int fl, sl;
 	mapping_insert(block_size(block), &fl, &sl);
-	insert_free_block(control, block, fl, sl);
+	insert_free_block(lists, block, fl, sl);
+	profile_record(lists_heap(lists), TLSF_PROFILE_INSERT, start);
 }
 
 static int block_can_split(block_header_t* block, size_t size)
@@ -656,7 +1212,11 @@ static block_header_t* block_split(block_header_t* block, size_t size)
 		&& "remaining block not aligned properly");
 
 	tlsf_assert(block_size(block) == remain_size + size + block_header_overhead);
-	block_set_size(remaining, remain_size);
+	/*
+	** The remaining block's size field was block data until now, so none
+	** of its status bits can be kept. The callers set its prev_free bit.
+	*/
+	remaining->size = remain_size;
 	tlsf_assert(block_size(remaining) >= block_size_min && "block split with invalid size");
 
 	block_set_size(block, size);
@@ -676,589 +1236,3919 @@ static block_header_t* block_absorb(block_header_t* prev, block_header_t* block)
 }
 
 /* Merge a just-freed block with an adjacent previous free block. */
-static block_header_t* block_merge_prev(control_t* control, block_header_t* block)
+static block_header_t* block_merge_prev(lists_t* lists, block_header_t* block)
 {
 	if (block_is_prev_free(block))
 	{
+		const unsigned long long start = profile_now();
 		block_header_t* prev = block_prev(block);
 		tlsf_assert(prev && "prev physical block can't be null");
 		tlsf_assert(block_is_free(prev) && "prev block is not free though marked as such");
-		block_remove(control, prev);
+		block_remove(lists, prev);
 		block = block_absorb(prev, block);
+		stats_count(lists_heap(lists), merges);
+		trace_merge(block);
+		profile_record(lists_heap(lists), TLSF_PROFILE_MERGE, start);
 	}
 
 	return block;
 }
 
 /* Merge a just-freed block with an adjacent free block. */
-static block_header_t* block_merge_next(control_t* control, block_header_t* block)
+static block_header_t* block_merge_next(lists_t* lists, block_header_t* block)
 {
 	block_header_t* next = block_next(block);
 	tlsf_assert(next && "next physical block can't be null");
 
 	if (block_is_free(next))
 	{
+		const unsigned long long start = profile_now();
 		tlsf_assert(!block_is_last(block) && "previous block can't be last");
-		block_remove(control, next);
+		block_remove(lists, next);
 		block = block_absorb(block, next);
+		stats_count(lists_heap(lists), merges);
+		trace_merge(block);
+		profile_record(lists_heap(lists), TLSF_PROFILE_MERGE, start);
 	}
 
 	return block;
 }
 
 /* Trim any trailing block space off the end of a block, return to pool. */
-static void block_trim_free(control_t* control, block_header_t* block, size_t size)
+static void block_trim_free(lists_t* lists, block_header_t* block, size_t size)
 {
 	tlsf_assert(block_is_free(block) && "block must be free");
 	if (block_can_split(block, size))
 	{
+		const unsigned long long start = profile_now();
 		block_header_t* remaining_block = block_split(block, size);
+		profile_record(lists_heap(lists), TLSF_PROFILE_SPLIT, start);
+		stats_count(lists_heap(lists), splits);
+		trace_split(block, remaining_block);
 		block_link_next(block);
 		block_set_prev_free(remaining_block);
-		block_insert(control, remaining_block);
+		block_insert(lists, remaining_block);
 	}
 }
 
 /* Trim any trailing block space off the end of a used block, return to pool. */
-static void block_trim_used(control_t* control, block_header_t* block, size_t size)
+static void block_trim_used(lists_t* lists, block_header_t* block, size_t size)
 {
 	tlsf_assert(!block_is_free(block) && "block must be used");
 	if (block_can_split(block, size))
 	{
 		/* If the next block is free, we must coalesce. */
+		const unsigned long long start = profile_now();
 		block_header_t* remaining_block = block_split(block, size);
+		profile_record(lists_heap(lists), TLSF_PROFILE_SPLIT, start);
+		stats_count(lists_heap(lists), splits);
+		trace_split(block, remaining_block);
 		block_set_prev_used(remaining_block);
 
-		remaining_block = block_merge_next(control, remaining_block);
-		block_insert(control, remaining_block);
+		remaining_block = block_merge_next(lists, remaining_block);
+		block_insert(lists, remaining_block);
 	}
 }
 
-static block_header_t* block_trim_free_leading(control_t* control, block_header_t* block, size_t size)
+/*
+** Free the first size bytes of a block, header included, and return the
+** rest. The caller ensures both parts are at least block_size_min.
+*/
+static block_header_t* block_free_leading(lists_t* lists, block_header_t* block, size_t size)
+{
+	const unsigned long long start = profile_now();
+	block_header_t* remaining_block = block_split(block, size - block_header_overhead);
+	profile_record(lists_heap(lists), TLSF_PROFILE_SPLIT, start);
+	stats_count(lists_heap(lists), splits);
+	trace_split(block, remaining_block);
+	block_set_prev_free(remaining_block);
+
+	block_link_next(block);
+	block_insert(lists, block);
+	return remaining_block;
+}
+
+static block_header_t* block_trim_free_leading(lists_t* lists, block_header_t* block, size_t size)
 {
 	block_header_t* remaining_block = block;
 	if (block_can_split(block, size))
 	{
 		/* We want the 2nd block. */
-		remaining_block = block_split(block, size - block_header_overhead);
-		block_set_prev_free(remaining_block);
-
-		block_link_next(block);
-		block_insert(control, block);
+		remaining_block = block_free_leading(lists, block, size);
 	}
 
 	return remaining_block;
 }
 
-static block_header_t* block_locate_free(control_t* control, size_t size)
+/* Return a used block to the free lists, coalescing with its neighbors. */
+static void block_release(lists_t* lists, block_header_t* block)
 {
-	int fl = 0, sl = 0;
-	block_header_t* block = 0;
+	block_mark_as_free(block);
+	block = block_merge_prev(lists, block);
+	block = block_merge_next(lists, block);
+	block_insert(lists, block);
+}
 
-	if (size)
+#if defined (TLSF_DEFER_COALESCE)
+/*
+** Deferred coalescing.
+**
+** A freed block in one of the small classes is pushed onto a per-class
+** list instead of being merged with its neighbors. It stays marked as
+** used in the physical chain, so no neighbor merges into it, and a later
+** request of the same class takes it back in O(1) without a split.
+**
+** Pending blocks are coalesced in bulk when a search fails, when a pool
+** is removed, or in budgeted steps through tlsf_coalesce. The worst case
+** for malloc and memalign is therefore DEFER_LIMIT ordinary frees on top
+** of the O(1) search; free stays O(1).
+**
+** Pending blocks are reported as used by tlsf_walk_pool. They carry
+** block_header_deferred_bit, so pool_rebuild frees them even when the
+** lists that held them are lost.
+*/
+static int block_defer(lists_t* lists, block_header_t* block)
+{
+	int fl, sl;
+
+	if (lists->deferred_count >= DEFER_LIMIT)
 	{
-		mapping_search(size, &fl, &sl);
-		
-		/*
-		** mapping_search can futz with the size, so for excessively large sizes it can sometimes wind up 
-		** with indices that are off the end of the block array.
-		** So, we protect against that here, since this is the only callsite of mapping_search.
-		** Note that we don't need to check sl, since it comes from a modulo operation that guarantees it's always in range.
-		*/
-		if (fl < FL_INDEX_COUNT)
-		{
-			block = search_suitable_block(control, &fl, &sl);
-		}
+		return 0;
 	}
 
-	if (block)
+	mapping_insert(block_size(block), &fl, &sl);
+	if (fl >= DEFER_FL_COUNT)
 	{
-		tlsf_assert(block_size(block) >= size);
-		remove_free_block(control, block, fl, sl);
+		return 0;
 	}
 
-	return block;
+	block->size |= block_header_deferred_bit;
+	block->next_free = lists->deferred[fl][sl];
+	lists->deferred[fl][sl] = block;
+	lists->deferred_bitmap[fl] |= (1U << sl);
+	lists->deferred_count++;
+	free_bytes_add(lists, block_size(block));
+	return 1;
 }
 
-static void* block_prepare_used(control_t* control, block_header_t* block, size_t size)
+static block_header_t* deferred_pop(lists_t* lists, int fl, int sl)
 {
-	void* p = 0;
-	if (block)
+	block_header_t* block = lists->deferred[fl][sl];
+	lists->deferred[fl][sl] = block->next_free;
+	if (!block->next_free)
 	{
-		tlsf_assert(size && "size must be non-zero");
-		block_trim_free(control, block, size);
-		block_mark_as_used(block);
-		p = block_to_ptr(block);
+		lists->deferred_bitmap[fl] &= ~(1U << sl);
 	}
-	return p;
+	lists->deferred_count--;
+	free_bytes_sub(lists, block_size(block));
+	block->size &= ~block_header_deferred_bit;
+	return block;
 }
 
-/* Clear structure and point all empty lists at the null block. */
-static void control_construct(control_t* control)
+/* Take a pending block whose class guarantees it can hold size bytes. */
+static block_header_t* block_undefer(lists_t* lists, size_t size)
 {
-	int i, j;
-
-	control->block_null.next_free = &control->block_null;
-	control->block_null.prev_free = &control->block_null;
+	int fl = 0, sl = 0;
+	block_header_t* block = 0;
 
-	control->fl_bitmap = 0;
-	for (i = 0; i < FL_INDEX_COUNT; ++i)
+	if (size)
 	{
-		control->sl_bitmap[i] = 0;
-		for (j = 0; j < SL_INDEX_COUNT; ++j)
+		mapping_search(size, &fl, &sl);
+		if (fl < DEFER_FL_COUNT && lists->deferred[fl][sl])
+		{
+			block = deferred_pop(lists, fl, sl);
+			tlsf_assert(block_size(block) >= size);
+		}
+	}
+
+	return block;
+}
+
+/* Coalesce up to max_blocks pending blocks; return how many remain. */
+static size_t lists_coalesce(lists_t* lists, size_t max_blocks)
+{
+	int fl = 0;
+	while (max_blocks && lists->deferred_count)
+	{
+		while (!lists->deferred_bitmap[fl])
 		{
-			control->blocks[i][j] = &control->block_null;
+			++fl;
 		}
+		block_release(lists,
+			deferred_pop(lists, fl, tlsf_ffs(lists->deferred_bitmap[fl])));
+		--max_blocks;
 	}
+	return lists->deferred_count;
 }
+#endif
 
 /*
-** Debugging utilities.
+** Take a free block of at least size bytes from class fl/sl or above,
+** where fl/sl is the class mapping_search gives for size.
 */
-
-typedef struct integrity_t
+static block_header_t* block_locate_class(lists_t* lists, size_t size, int fl, int sl)
 {
-	int prev_status;
-	int status;
-} integrity_t;
+	const unsigned long long start = profile_now();
+	block_header_t* block = 0;
 
-#define tlsf_insist(x) { tlsf_assert(x); if (!(x)) { status--; } }
+	/*
+	** mapping_search can futz with the size, so for excessively large sizes it can sometimes wind up 
+	** with indices that are off the end of the block array.
+	** So, we protect against that here.
+	** Note that we don't need to check sl, since it comes from a modulo operation that guarantees it's always in range.
+	*/
+	if (size && fl < FL_INDEX_COUNT)
+	{
+		block = search_suitable_block(lists, &fl, &sl);
 
-static void integrity_walker(void* ptr, size_t size, int used, void* user)
-{
-	block_header_t* block = block_from_ptr(ptr);
-	integrity_t* integ = tlsf_cast(integrity_t*, user);
-	const int this_prev_status = block_is_prev_free(block) ? 1 : 0;
-	const int this_status = block_is_free(block) ? 1 : 0;
-	const size_t this_block_size = block_size(block);
+#if defined (TLSF_DEFER_COALESCE)
+		/* Coalescing pending blocks may produce a large enough block. */
+		if (!block && lists->deferred_count)
+		{
+			lists_coalesce(lists, DEFER_LIMIT);
+			mapping_search(size, &fl, &sl);
+			block = search_suitable_block(lists, &fl, &sl);
+		}
+#endif
+	}
 
-	int status = 0;
-	(void)used;
-	tlsf_insist(integ->prev_status == this_prev_status && "prev status incorrect");
-	tlsf_insist(size == this_block_size && "block size incorrect");
+	if (block)
+	{
+		tlsf_assert(block_size(block) >= size);
+		remove_free_block(lists, block, fl, sl);
+	}
+	else if (size)
+	{
+		stats_count(lists_heap(lists), failed_searches);
+	}
 
-	integ->prev_status = this_status;
-	integ->status += status;
+	profile_record(lists_heap(lists), TLSF_PROFILE_SEARCH, start);
+	return block;
 }
 
-int tlsf_check(tlsf_t tlsf)
+static block_header_t* block_locate_free(lists_t* lists, size_t size)
 {
-	int i, j;
+	int fl = 0, sl = 0;
+	if (size)
+	{
+		mapping_search(size, &fl, &sl);
+	}
+	return block_locate_class(lists, size, fl, sl);
+}
 
-	control_t* control = tlsf_cast(control_t*, tlsf);
-	int status = 0;
+/*
+** Offset from a free block's data to the first address aligned to align
+** at which the block can be split. A nonzero gap must be large enough to
+** hold a free block of its own, see tlsf_memalign.
+*/
+static size_t block_align_gap(const block_header_t* block, size_t align)
+{
+	const size_t gap_minimum = sizeof(block_header_t);
+	void* ptr = block_to_ptr(block);
+	void* aligned = align_ptr(ptr, align);
+	size_t gap = tlsf_cast(size_t,
+		tlsf_cast(tlsfptr_t, aligned) - tlsf_cast(tlsfptr_t, ptr));
 
-	/* Check that the free lists and bitmaps are accurate. */
-	for (i = 0; i < FL_INDEX_COUNT; ++i)
+	/* If gap size is too small, offset to next aligned boundary. */
+	if (gap && gap < gap_minimum)
 	{
-		for (j = 0; j < SL_INDEX_COUNT; ++j)
-		{
-			const int fl_map = control->fl_bitmap & (1U << i);
-			const int sl_list = control->sl_bitmap[i];
-			const int sl_map = sl_list & (1U << j);
-			const block_header_t* block = control->blocks[i][j];
+		const size_t gap_remain = gap_minimum - gap;
+		const size_t offset = tlsf_max(gap_remain, align);
+		const void* next_aligned = tlsf_cast(void*,
+			tlsf_cast(tlsfptr_t, aligned) + offset);
 
-			/* Check that first- and second-level lists agree. */
-			if (!fl_map)
-			{
-				tlsf_insist(!sl_map && "second-level map must be null");
-			}
+		aligned = align_ptr(next_aligned, align);
+		gap = tlsf_cast(size_t,
+			tlsf_cast(tlsfptr_t, aligned) - tlsf_cast(tlsfptr_t, ptr));
+	}
 
-			if (!sl_map)
-			{
-				tlsf_insist(block == &control->block_null && "block list must be null");
-				continue;
-			}
+	return gap;
+}
 
-			/* Check that there is at least one free block. */
-			tlsf_insist(sl_list && "no free blocks in second-level map");
-			tlsf_insist(block != &control->block_null && "block should not be null");
+/*
+** Look for a free block that already holds size bytes at an aligned
+** address, starting from the lists that can hold size bytes at all. At
+** most ALIGN_PROBE_LIMIT blocks are inspected, keeping this O(1).
+*/
+static block_header_t* block_locate_aligned(lists_t* lists, size_t size, size_t align)
+{
+	int fl_min = 0, sl_min = 0;
+	int probes = ALIGN_PROBE_LIMIT;
+	unsigned int fl_map;
 
-			while (block != &control->block_null)
-			{
-				int fli, sli;
-				tlsf_insist(block_is_free(block) && "block should be free");
-				tlsf_insist(!block_is_prev_free(block) && "blocks should have coalesced");
-				tlsf_insist(!block_is_free(block_next(block)) && "blocks should have coalesced");
-				tlsf_insist(block_is_prev_free(block_next(block)) && "block should be free");
-				tlsf_insist(block_size(block) >= block_size_min && "block not minimum size");
+	mapping_search(size, &fl_min, &sl_min);
+	if (fl_min >= FL_INDEX_COUNT)
+	{
+		return 0;
+	}
 
-				mapping_insert(block_size(block), &fli, &sli);
-				tlsf_insist(fli == i && sli == j && "block size indexed in wrong list");
-				block = block->next_free;
+	fl_map = lists->fl_bitmap & (~0U << fl_min);
+	while (fl_map)
+	{
+		const int fl = tlsf_ffs(fl_map);
+		unsigned int sl_map = lists->sl_bitmap[fl];
+		if (fl == fl_min)
+		{
+			sl_map &= ~0U << sl_min;
+		}
+
+		while (sl_map)
+		{
+			const int sl = tlsf_ffs(sl_map);
+			block_header_t* block;
+			for (block = lists->blocks[fl][sl];
+				block != &lists->block_null;
+				block = block->next_free)
+			{
+				const size_t gap = block_align_gap(block, align);
+				if (block_size(block) >= gap + size
+					&& (!gap || block_can_split(block, gap)))
+				{
+					remove_free_block(lists, block, fl, sl);
+					return block;
+				}
+
+				if (--probes == 0)
+				{
+					return 0;
+				}
 			}
+			sl_map &= sl_map - 1;
 		}
+		fl_map &= ~(1U << fl);
 	}
 
-	return status;
+	return 0;
 }
 
-#undef tlsf_insist
+static void* block_prepare_used(lists_t* lists, block_header_t* block, size_t size)
+{
+	void* p = 0;
+	if (block)
+	{
+		tlsf_assert(size && "size must be non-zero");
+		block_trim_free(lists, block, size);
+		block_mark_as_used(block);
+		p = block_to_ptr(block);
+	}
+	return p;
+}
 
-static void default_walker(void* ptr, size_t size, int used, void* user)
+/*
+** Like block_prepare_used, but hand out the end of the block and keep its
+** start free. Short-lived blocks placed this way collect at the high end
+** of free space, away from the longer-lived blocks taken from the low
+** end, so their frees coalesce back into large blocks.
+*/
+static void* block_prepare_used_high(lists_t* lists, block_header_t* block, size_t size)
 {
-	(void)user;
-	printf("\t%p %s size: %x (%p)\n", ptr, used ? "used" : "free", (unsigned int)size, block_from_ptr(ptr));
+	/*
+	** The leading part needs room for a free block. block_can_split would
+	** also demand a whole header's worth of the end, which small requests
+	** do not have.
+	*/
+	if (block && block_size(block) >= size + sizeof(block_header_t))
+	{
+		block = block_free_leading(lists, block, block_size(block) - size);
+	}
+	return block_prepare_used(lists, block, size);
 }
 
-void tlsf_walk_pool(pool_t pool, tlsf_walker walker, void* user)
+/* Point all empty lists at the null block. */
+static void lists_construct(lists_t* lists)
 {
-	tlsf_walker pool_walker = walker ? walker : default_walker;
-	block_header_t* block =
-		offset_to_block(pool, -(int)block_header_overhead);
+	int i, j;
 
-	while (block && !block_is_last(block))
+	lists->block_null.next_free = &lists->block_null;
+	lists->block_null.prev_free = &lists->block_null;
+
+	lists->fl_bitmap = 0;
+	for (i = 0; i < FL_INDEX_COUNT; ++i)
 	{
-		pool_walker(
-			block_to_ptr(block),
-			block_size(block),
-			!block_is_free(block),
-			user);
-		block = block_next(block);
+		lists->sl_bitmap[i] = 0;
+		for (j = 0; j < SL_INDEX_COUNT; ++j)
+		{
+			lists->blocks[i][j] = &lists->block_null;
+		}
+	}
+
+#if defined (TLSF_PRIO)
+	lists->free_bytes = 0;
+#endif
+
+#if defined (TLSF_DEFER_COALESCE)
+	lists->deferred_count = 0;
+	for (i = 0; i < DEFER_FL_COUNT; ++i)
+	{
+		lists->deferred_bitmap[i] = 0;
+		for (j = 0; j < SL_INDEX_COUNT; ++j)
+		{
+			lists->deferred[i][j] = 0;
+		}
 	}
+#endif
+
+#if defined (TLSF_POOL_LISTS)
+	lists->heap = 0;
+	lists->pool_slot = 0;
+	lists->pool_end = 0;
+	lists->pool_published = 0;
+	lists->pool_draining = 0;
+	lists->pool_used = 0;
+#if defined (TLSF_PRIO)
+	lists->pool_free_published = 0;
+#endif
+#endif
 }
 
-size_t tlsf_block_size(void* ptr)
+/* Clear structure and point all empty lists at the null block. */
+static void control_construct(control_t* control)
 {
-	size_t size = 0;
-	if (ptr)
+#if defined (TLSF_PRIO) || defined (TLSF_POOL_LISTS)
+	int i;
+#endif
+
+#if !defined (TLSF_POOL_LISTS)
+	lists_construct(&control->lists);
+#endif
+
+#if defined (TLSF_PRIO)
+	for (i = 0; i < TLSF_PRIO_COUNT; ++i)
 	{
-		const block_header_t* block = block_from_ptr(ptr);
-		size = block_size(block);
+		control->prio_watermark[i] = 0;
+		control->prio_denied[i] = 0;
 	}
-	return size;
+#endif
+
+#if defined (TLSF_LOCK)
+	memset(&control->lock, 0, sizeof(control->lock));
+#endif
+
+#if defined (TLSF_STATS)
+	memset(&control->stats, 0, sizeof(control->stats));
+#endif
+
+#if defined (TLSF_PROFILE)
+	memset(&control->profile, 0, sizeof(control->profile));
+#endif
+
+#if defined (TLSF_TAGS)
+	memset(control->tags, 0, sizeof(control->tags));
+#endif
+
+#if defined (TLSF_MMAP)
+	control->mmap_threshold = MMAP_THRESHOLD;
+#endif
+
+#if defined (TLSF_POOL_LISTS)
+	control->pool_count = 0;
+	control->pool_fl_bitmap = 0;
+	for (i = 0; i < FL_INDEX_COUNT; ++i)
+	{
+		control->pool_fl_map[i] = 0;
+	}
+	for (i = 0; i < POOL_COUNT_MAX; ++i)
+	{
+		control->pool_slots[i] = 0;
+		control->pool_sorted[i] = 0;
+	}
+	control->pool_drained_handler = 0;
+	control->pool_drained_user = 0;
+	control->pool_drained = 0;
+#if defined (TLSF_PRIO)
+	control->pool_free = 0;
+#endif
+#endif
 }
 
-int tlsf_check_pool(pool_t pool)
+#if defined (TLSF_POOL_LISTS)
+/*
+** Per-pool free lists.
+**
+** Each pool starts with a lists_t holding the free lists of that pool
+** alone, so blocks can be taken from a chosen pool. The heap's control_t
+** keeps a table of its pools instead of free lists: for every
+** first-level index, a mask of the pools with a free block there, plus a
+** bitmap of the indices where any pool has one. Choosing a pool is then
+** two bit scans and at most one second-level check per pool. Blocks never
+** merge across pools, so each block operation works on a single pool's
+** lists, and the pool's first-level bitmap is republished afterwards.
+**
+** A draining pool publishes no free blocks, so nothing new is placed in
+** it while its blocks are freed as usual. Once its used byte count drops
+** to zero, the heap's drained handler is called for it after the lock is
+** released, so the handler may remove the pool.
+*/
+
+static const size_t pool_header_size = sizeof(lists_t);
+
+static lists_t* pool_lists(control_t* control, pool_t pool)
 {
-	/* Check that the blocks are physically correct. */
-	integrity_t integ = { 0, 0 };
-	tlsf_walk_pool(pool, integrity_walker, &integ);
+	(void)control;
+	return tlsf_cast(lists_t*, tlsf_cast(char*, pool) - pool_header_size);
+}
 
-	return integ.status;
+/* Bring the heap's pool masks up to date with a pool's free lists. */
+static void pool_sync(control_t* control, lists_t* lists)
+{
+	const unsigned int current = lists->pool_draining ? 0 : lists->fl_bitmap;
+	const unsigned int bit = 1U << lists->pool_slot;
+	unsigned int changed = current ^ lists->pool_published;
+
+	while (changed)
+	{
+		const int fl = tlsf_ffs(changed);
+		changed &= changed - 1;
+
+		if (current & (1U << fl))
+		{
+			control->pool_fl_map[fl] |= bit;
+			control->pool_fl_bitmap |= (1U << fl);
+		}
+		else
+		{
+			control->pool_fl_map[fl] &= ~bit;
+			if (!control->pool_fl_map[fl])
+			{
+				control->pool_fl_bitmap &= ~(1U << fl);
+			}
+		}
+	}
+	lists->pool_published = current;
+
+#if defined (TLSF_PRIO)
+	{
+		const size_t free_bytes = lists->pool_draining ? 0 : lists->free_bytes;
+		control->pool_free += free_bytes - lists->pool_free_published;
+		lists->pool_free_published = free_bytes;
+	}
+#endif
 }
 
 /*
-** Size of the TLSF structures in a given memory block passed to
-** tlsf_create, equal to the size of a control_t
+** Find a pool with a free block of at least size bytes; with lowest set,
+** the lowest-addressed such pool, so long-lived blocks collect in as few
+** pools as possible.
 */
-size_t tlsf_size(void)
+static lists_t* pool_find(control_t* control, size_t size, int lowest)
 {
-	return sizeof(control_t);
+	int fl = 0, sl = 0, i;
+	unsigned int pools, fl_map;
+
+	if (!size)
+	{
+		return 0;
+	}
+
+	mapping_search(size, &fl, &sl);
+	if (fl >= FL_INDEX_COUNT)
+	{
+		return 0;
+	}
+
+	for (i = 0; lowest && i < control->pool_count; ++i)
+	{
+		lists_t* lists = control->pool_sorted[i];
+		if ((lists->pool_published & (~0U << (fl + 1)))
+			|| ((lists->pool_published & (1U << fl)) && (lists->sl_bitmap[fl] & (~0U << sl))))
+		{
+			return lists;
+		}
+	}
+
+	/* Pools with blocks in this first-level list may still be too small. */
+	pools = control->pool_fl_map[fl];
+	while (pools)
+	{
+		lists_t* lists = control->pool_slots[tlsf_ffs(pools)];
+		if (lists->sl_bitmap[fl] & (~0U << sl))
+		{
+			return lists;
+		}
+		pools &= pools - 1;
+	}
+
+	/* Any pool with a block in a larger first-level list will do. */
+	fl_map = control->pool_fl_bitmap & (~0U << (fl + 1));
+	if (fl_map)
+	{
+		return control->pool_slots[tlsf_ffs(control->pool_fl_map[tlsf_ffs(fl_map)])];
+	}
+	return 0;
 }
 
-size_t tlsf_align_size(void)
+/* Find the pool holding a block; pools are kept sorted by address. */
+static lists_t* pool_of_block(control_t* control, const block_header_t* block)
 {
-	return ALIGN_SIZE;
+	const tlsfptr_t address = tlsf_cast(tlsfptr_t, block);
+	int lo = 0, hi = control->pool_count;
+
+	while (lo < hi)
+	{
+		const int mid = (lo + hi) / 2;
+		if (tlsf_cast(tlsfptr_t, control->pool_sorted[mid]) <= address)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	tlsf_assert(lo > 0 && "block not in any pool of this heap");
+	tlsf_assert(address < tlsf_cast(tlsfptr_t, control->pool_sorted[lo - 1]->pool_end)
+		&& "block not in any pool of this heap");
+	return control->pool_sorted[lo - 1];
 }
 
-size_t tlsf_block_size_min(void)
+static int pool_register(control_t* control, lists_t* lists, void* end)
 {
-	return block_size_min;
+	int slot = 0, i;
+
+	if (control->pool_count == POOL_COUNT_MAX)
+	{
+		return 0;
+	}
+
+	while (control->pool_slots[slot])
+	{
+		++slot;
+	}
+	control->pool_slots[slot] = lists;
+	lists->pool_slot = slot;
+	lists->pool_end = end;
+	lists->pool_published = 0;
+#if defined (TLSF_PRIO)
+	lists->pool_free_published = 0;
+#endif
+
+	for (i = control->pool_count; i > 0; --i)
+	{
+		if (tlsf_cast(tlsfptr_t, control->pool_sorted[i - 1]) < tlsf_cast(tlsfptr_t, lists))
+		{
+			break;
+		}
+		control->pool_sorted[i] = control->pool_sorted[i - 1];
+	}
+	control->pool_sorted[i] = lists;
+	++control->pool_count;
+
+	pool_sync(control, lists);
+	return 1;
+}
+
+/* Forget a pool whose free lists have already been emptied. */
+static void pool_unregister(control_t* control, lists_t* lists)
+{
+	int i;
+
+	pool_sync(control, lists);
+	control->pool_slots[lists->pool_slot] = 0;
+
+	for (i = 0; control->pool_sorted[i] != lists; ++i)
+	{
+	}
+	for (--control->pool_count; i < control->pool_count; ++i)
+	{
+		control->pool_sorted[i] = control->pool_sorted[i + 1];
+	}
+	control->pool_sorted[i] = 0;
+}
+
+#define pool_used_add(lists, size) ((lists)->pool_used += (size))
+#define heap_free_bytes(control) ((control)->pool_free)
+#define pool_used_sub(lists, size) ((lists)->pool_used -= (size))
+
+/* Note a draining pool whose last used block was just freed. */
+static void pool_check_drained(control_t* control, lists_t* lists)
+{
+	if (lists->pool_draining && !lists->pool_used)
+	{
+#if defined (TLSF_DEFER_COALESCE)
+		lists_coalesce(lists, DEFER_LIMIT);
+#endif
+		control->pool_drained = lists;
+	}
+}
+
+/* Blocks of a draining pool may shrink but not grow into free space. */
+static int pool_may_grow(control_t* control, const block_header_t* block)
+{
+	return !pool_of_block(control, block)->pool_draining;
+}
+
+/* Take the drain to report, if any; called with the lock held. */
+static lists_t* pool_take_drained(control_t* control)
+{
+	lists_t* drained = control->pool_drained;
+	control->pool_drained = 0;
+	return drained;
+}
+
+/* Report a drained pool; called once the lock has been released. */
+static void pool_notify_drained(control_t* control, lists_t* drained)
+{
+	const tlsf_pool_handler handler = control->pool_drained_handler;
+	if (drained && handler)
+	{
+		handler(tlsf_cast(tlsf_t, control),
+			tlsf_cast(pool_t, tlsf_cast(char*, drained) + pool_header_size),
+			control->pool_drained_user);
+	}
+}
+#else
+/* A heap's pools share its free lists. */
+static const size_t pool_header_size = 0;
+
+#define pool_lists(control, pool) (&(control)->lists)
+#define pool_sync(control, lists) ((void)(control))
+#define pool_of_block(control, block) (&(control)->lists)
+#define pool_used_add(lists, size) ((void)0)
+#define heap_free_bytes(control) ((control)->lists.free_bytes)
+#define pool_used_sub(lists, size) ((void)0)
+#define pool_check_drained(control, lists) ((void)0)
+#define pool_may_grow(control, block) ((void)(control), 1)
+#define pool_take_drained(control) 0
+#define pool_notify_drained(control, drained) ((void)(drained))
+#endif
+
+#if defined (TLSF_DEFER_COALESCE)
+/* Coalesce up to max_blocks deferred blocks across the whole heap. */
+static size_t heap_coalesce(control_t* control, size_t max_blocks)
+{
+#if defined (TLSF_POOL_LISTS)
+	size_t pending = 0;
+	int i;
+
+	for (i = 0; i < control->pool_count; ++i)
+	{
+		lists_t* lists = control->pool_sorted[i];
+		const size_t before = lists->deferred_count;
+		const size_t after = lists_coalesce(lists, max_blocks);
+
+		max_blocks -= before - after;
+		pending += after;
+		pool_sync(control, lists);
+	}
+	return pending;
+#else
+	return lists_coalesce(&control->lists, max_blocks);
+#endif
+}
+#endif
+
+#if defined (TLSF_POOL_LISTS)
+/* Choose the pool to allocate size bytes from, or return null. */
+static lists_t* pool_search(control_t* control, size_t size, int lowest)
+{
+	lists_t* lists = pool_find(control, size, lowest);
+
+#if defined (TLSF_DEFER_COALESCE)
+	/* Coalescing pending blocks may produce a large enough block. */
+	if (!lists && size && heap_coalesce(control, 0))
+	{
+		heap_coalesce(control, DEFER_LIMIT * POOL_COUNT_MAX);
+		lists = pool_find(control, size, lowest);
+	}
+#endif
+	return lists;
+}
+
+/* As pool_search, counting a search that finds no pool as failed. */
+static lists_t* pool_select(control_t* control, size_t size, int lowest)
+{
+	lists_t* lists = pool_search(control, size, lowest);
+	if (!lists && size)
+	{
+		stats_count(control, failed_searches);
+	}
+	return lists;
+}
+#else
+#define pool_search(control, size, lowest) (&(control)->lists)
+#define pool_select(control, size, lowest) (&(control)->lists)
+#endif
+
+#if defined (TLSF_TAGS)
+/*
+** Allocation tags. Every used block carries a tag, 0 unless one was
+** given, and the heap keeps live byte and block counts for each tag.
+** Tags are set by the public entry points once a block is allocated, and
+** counted out again when it is freed or resized.
+*/
+
+static unsigned int block_tag(const block_header_t* block)
+{
+	return tlsf_cast(unsigned int, block->size >> block_header_tag_shift);
+}
+
+static void control_tag(control_t* control, void* ptr, unsigned int tag)
+{
+	if (ptr)
+	{
+		block_header_t* block = block_from_ptr(ptr);
+		tlsf_assert(tag < TLSF_TAG_COUNT && "tag out of range");
+		tag &= TLSF_TAG_COUNT - 1;
+
+		block->size = (block->size & ~block_header_tag_bits)
+			| (tlsf_cast(size_t, tag) << block_header_tag_shift);
+		control->tags[tag].bytes += block_size(block);
+		control->tags[tag].count++;
+	}
+}
+
+static void control_untag(control_t* control, const block_header_t* block)
+{
+	const unsigned int tag = block_tag(block);
+	control->tags[tag].bytes -= block_size(block);
+	control->tags[tag].count--;
+}
+
+/* Count the used blocks of an attached pool under their stored tags. */
+static void tag_walker(void* ptr, size_t size, int used, void* user)
+{
+	(void)size;
+	if (used)
+	{
+		control_tag(tlsf_cast(control_t*, user), ptr, block_tag(block_from_ptr(ptr)));
+	}
+}
+#else
+#define control_tag(control, ptr, tag) ((void)0)
+#define control_untag(control, block) ((void)(control))
+#endif
+
+#if defined (TLSF_MMAP)
+/*
+** Directly mapped blocks.
+**
+** Requests of at least the heap's mmap threshold get a mapping of their
+** own instead of a block from a pool, so they never fragment the pools
+** and realloc can resize them with mremap instead of copying. A mapped
+** block has a header like any other: its size field holds the usable size
+** with both the free and prev-free bits set, which no used pool block
+** carries, and its prev_phys_block field holds the start of the mapping.
+*/
+
+static const size_t block_header_mapped_bits =
+	block_header_free_bit | block_header_prev_free_bit;
+
+static size_t mapped_page_size(void)
+{
+	return tlsf_cast(size_t, sysconf(_SC_PAGESIZE));
+}
+
+static int block_is_mapped(const block_header_t* block)
+{
+	return (block->size & block_header_mapped_bits) == block_header_mapped_bits;
+}
+
+/* Offset of the payload from the start of the mapping. */
+static size_t mapped_offset(const block_header_t* block)
+{
+	return tlsf_cast(size_t, tlsf_cast(const char*, block_to_ptr(block))
+		- tlsf_cast(const char*, block->prev_phys_block));
+}
+
+static size_t mapped_length(const block_header_t* block)
+{
+	return mapped_offset(block) + block_size(block);
+}
+
+#define mapped_wanted(control, size) \
+	((control)->mmap_threshold && (size) >= (control)->mmap_threshold)
+
+/*
+** Map a block of at least size bytes aligned to align, or return null.
+** Aligning the data may skip up to align - 1 bytes past the header, so
+** the mapping has that much slack on top of the header and size.
+*/
+static void* mapped_alloc(size_t size, size_t align)
+{
+	const size_t page = mapped_page_size();
+	const size_t slack = align > ALIGN_SIZE ? align - 1 : 0;
+	const size_t limit = ~tlsf_cast(size_t, 0) - block_start_offset - slack - page;
+	size_t length;
+	char* base;
+	void* ptr;
+	block_header_t* block;
+
+	if (size > limit)
+	{
+		return 0;
+	}
+	length = align_up(size + block_start_offset + slack, page);
+
+	/* Page-sized lengths only reach the deferred bit on 32-bit builds. */
+	if (length & block_header_deferred_bit)
+	{
+		return 0;
+	}
+
+	base = tlsf_cast(char*, mmap(0, length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (tlsf_cast(void*, base) == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	ptr = align_ptr(base + block_start_offset, tlsf_max(align, tlsf_cast(size_t, ALIGN_SIZE)));
+	block = block_from_ptr(ptr);
+	block->prev_phys_block = tlsf_cast(block_header_t*, base);
+	block->size = tlsf_cast(size_t, base + length - tlsf_cast(char*, ptr))
+		| block_header_mapped_bits;
+	tlsf_assert(block_size(block) >= size && "mapping too small for request");
+	return ptr;
+}
+
+static void mapped_free(block_header_t* block)
+{
+	munmap(tlsf_cast(void*, block->prev_phys_block), mapped_length(block));
+}
+
+/*
+** Resize a mapped block to hold at least size bytes, moving it if
+** may_move is set. Returns the new pointer, or null with the block left
+** as it was. Only Linux has mremap; elsewhere this always fails and
+** callers fall back to copying.
+*/
+static void* mapped_resize(block_header_t* block, size_t size, int may_move)
+{
+#if defined (__linux__)
+	const size_t page = mapped_page_size();
+	const size_t offset = mapped_offset(block);
+	size_t length;
+	char* base;
+
+	if (size > ~tlsf_cast(size_t, 0) - offset - page)
+	{
+		return 0;
+	}
+	length = align_up(offset + size, page);
+	if (length & block_header_deferred_bit)
+	{
+		return 0;
+	}
+
+	base = tlsf_cast(char*, mremap(tlsf_cast(void*, block->prev_phys_block),
+		mapped_length(block), length, may_move ? MREMAP_MAYMOVE : 0));
+	if (tlsf_cast(void*, base) == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	block = tlsf_cast(block_header_t*, base + offset - block_start_offset);
+	block->prev_phys_block = tlsf_cast(block_header_t*, base);
+	block_set_size(block, length - offset);
+	return block_to_ptr(block);
+#else
+	(void)block;
+	(void)size;
+	(void)may_move;
+	return 0;
+#endif
+}
+#else
+#define block_is_mapped(block) 0
+#define mapped_wanted(control, size) 0
+#define mapped_alloc(size, align) 0
+#define mapped_free(block) ((void)0)
+#endif
+
+#if defined (TLSF_REGISTRY)
+/*
+** Process-wide pool registry.
+**
+** Each pool added in this process is recorded as an address range owned
+** by its heap, so a block's heap can be found from its address alone. The
+** ranges are kept sorted and disjoint. A pool inside a block of another
+** heap's pool, as the chunks of a child heap are, splits the range around
+** it, which is restored when the inner pool goes away.
+**
+** Lookups binary-search the array under a sequence lock: they never block
+** or write shared memory, and a reader that overlaps an update searches
+** again. Updates take a spin lock and only happen as pools come and go.
+*/
+#if !defined (__GNUC__)
+#error TLSF_REGISTRY requires GCC-compatible atomic builtins.
+#endif
+
+typedef struct registry_entry_t
+{
+	tlsfptr_t start;
+	tlsfptr_t end;
+	/* Owning heap and pool, and those of the range this one lies in. */
+	control_t* heap;
+	tlsfptr_t pool;
+	control_t* outer_heap;
+	tlsfptr_t outer_pool;
+} registry_entry_t;
+
+static struct
+{
+	int lock;
+	unsigned int sequence;
+	int count;
+	registry_entry_t entries[REGISTRY_MAX];
+} registry;
+
+/* Updates make the sequence odd while they are in progress. */
+static void registry_write_begin(void)
+{
+	while (__atomic_exchange_n(&registry.lock, 1, __ATOMIC_ACQUIRE))
+	{
+		while (__atomic_load_n(&registry.lock, __ATOMIC_RELAXED))
+		{
+		}
+	}
+	__atomic_store_n(&registry.sequence, registry.sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void registry_write_end(void)
+{
+	__atomic_store_n(&registry.sequence, registry.sequence + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&registry.lock, 0, __ATOMIC_RELEASE);
+}
+
+static void registry_store(int i, const registry_entry_t* entry)
+{
+	registry_entry_t* slot = &registry.entries[i];
+	__atomic_store_n(&slot->start, entry->start, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->end, entry->end, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->heap, entry->heap, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->pool, entry->pool, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->outer_heap, entry->outer_heap, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->outer_pool, entry->outer_pool, __ATOMIC_RELAXED);
+}
+
+/* Replace removed entries from index i with count new ones. */
+static void registry_splice(int i, int removed, const registry_entry_t* pieces, int count)
+{
+	const int shift = count - removed;
+	int j;
+
+	if (shift > 0)
+	{
+		for (j = registry.count - 1; j >= i + removed; --j)
+		{
+			registry_store(j + shift, &registry.entries[j]);
+		}
+	}
+	for (j = 0; j < count; ++j)
+	{
+		registry_store(i + j, &pieces[j]);
+	}
+	__atomic_store_n(&registry.count, registry.count + shift, __ATOMIC_RELAXED);
+}
+
+/*
+** Record a pool of heap, named by the pointer tlsf_add_pool returns, that
+** spans bytes from mem. Fails if the range partly overlaps another.
+*/
+static int registry_add(control_t* heap, void* mem, size_t bytes, void* pool, const char* caller)
+{
+	registry_entry_t entry;
+	registry_entry_t pieces[3];
+	int lo = 0, hi, count = 0, removed = 0;
+
+	entry.start = tlsf_cast(tlsfptr_t, mem);
+	entry.end = entry.start + tlsf_cast(tlsfptr_t, bytes);
+	entry.heap = heap;
+	entry.pool = tlsf_cast(tlsfptr_t, pool);
+	entry.outer_heap = 0;
+	entry.outer_pool = 0;
+
+	registry_write_begin();
+
+	/* Find the first range that ends past the start. */
+	hi = registry.count;
+	while (lo < hi)
+	{
+		const int mid = (lo + hi) / 2;
+		if (registry.entries[mid].end <= entry.start)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (lo == registry.count || entry.end <= registry.entries[lo].start)
+	{
+		pieces[count++] = entry;
+	}
+	else if (registry.entries[lo].start <= entry.start && entry.end <= registry.entries[lo].end)
+	{
+		/* Split the enclosing range around the new one. */
+		const registry_entry_t outer = registry.entries[lo];
+		entry.outer_heap = outer.heap;
+		entry.outer_pool = outer.pool;
+		if (outer.start < entry.start)
+		{
+			pieces[count] = outer;
+			pieces[count++].end = entry.start;
+		}
+		pieces[count++] = entry;
+		if (entry.end < outer.end)
+		{
+			pieces[count] = outer;
+			pieces[count++].start = entry.end;
+		}
+		removed = 1;
+	}
+
+	if (!count)
+	{
+		printf("%s: Memory overlaps a registered pool.\n", caller);
+	}
+	else if (registry.count + count - removed > REGISTRY_MAX)
+	{
+		printf("%s: The pool registry holds at most %u ranges.\n", caller,
+			(unsigned int)REGISTRY_MAX);
+		count = 0;
+	}
+	else
+	{
+		registry_splice(lo, removed, pieces, count);
+	}
+
+	registry_write_end();
+	return count != 0;
+}
+
+/* Give entry the outer range of the pool it now belongs to. */
+static void registry_find_outer(registry_entry_t* entry)
+{
+	int i;
+
+	entry->outer_heap = 0;
+	entry->outer_pool = 0;
+	for (i = 0; entry->heap && i < registry.count; ++i)
+	{
+		const registry_entry_t* other = &registry.entries[i];
+		if (other->heap == entry->heap && other->pool == entry->pool)
+		{
+			entry->outer_heap = other->outer_heap;
+			entry->outer_pool = other->outer_pool;
+			return;
+		}
+	}
+}
+
+/*
+** Drop a pool of heap, or all of them if pool is null. Its ranges go back
+** to the pool they lay in, if any, along with any ranges still inside it.
+*/
+static void registry_release(control_t* heap, void* pool)
+{
+	const tlsfptr_t key = tlsf_cast(tlsfptr_t, pool);
+	registry_entry_t entry;
+	int i, count = 0;
+
+	registry_write_begin();
+
+	for (i = 0; i < registry.count; ++i)
+	{
+		entry = registry.entries[i];
+		if (entry.outer_heap == heap && (!pool || entry.outer_pool == key))
+		{
+			entry.heap = entry.outer_heap;
+			entry.pool = entry.outer_pool;
+			registry_find_outer(&entry);
+			registry_store(i, &entry);
+		}
+	}
+
+	for (i = 0; i < registry.count; ++i)
+	{
+		entry = registry.entries[i];
+		if (entry.heap == heap && (!pool || entry.pool == key))
+		{
+			entry.heap = entry.outer_heap;
+			entry.pool = entry.outer_pool;
+			registry_find_outer(&entry);
+			registry_store(i, &entry);
+		}
+	}
+
+	/* Remove dropped ranges and rejoin the pieces of each pool. */
+	for (i = 0; i < registry.count; ++i)
+	{
+		entry = registry.entries[i];
+		if (!entry.heap)
+		{
+			continue;
+		}
+		if (count && registry.entries[count - 1].end == entry.start
+			&& registry.entries[count - 1].heap == entry.heap
+			&& registry.entries[count - 1].pool == entry.pool)
+		{
+			__atomic_store_n(&registry.entries[count - 1].end, entry.end, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			registry_store(count++, &entry);
+		}
+	}
+	__atomic_store_n(&registry.count, count, __ATOMIC_RELAXED);
+
+	registry_write_end();
+}
+
+/* Find the heap of the pool holding ptr, or null. */
+static control_t* registry_find(const void* ptr)
+{
+	const tlsfptr_t address = tlsf_cast(tlsfptr_t, ptr);
+	unsigned int sequence;
+	control_t* owner;
+
+	do
+	{
+		int lo = 0, hi;
+
+		sequence = __atomic_load_n(&registry.sequence, __ATOMIC_ACQUIRE);
+		hi = __atomic_load_n(&registry.count, __ATOMIC_RELAXED);
+		owner = 0;
+		while (lo < hi)
+		{
+			const registry_entry_t* entry = &registry.entries[(lo + hi) / 2];
+			if (address < __atomic_load_n(&entry->start, __ATOMIC_RELAXED))
+			{
+				hi = (lo + hi) / 2;
+			}
+			else if (address >= __atomic_load_n(&entry->end, __ATOMIC_RELAXED))
+			{
+				lo = (lo + hi) / 2 + 1;
+			}
+			else
+			{
+				owner = __atomic_load_n(&entry->heap, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((sequence & 1) || sequence != __atomic_load_n(&registry.sequence, __ATOMIC_RELAXED));
+
+	return owner;
+}
+#else
+#define registry_add(heap, mem, bytes, pool, caller) 1
+#define registry_release(heap, pool) ((void)(heap))
+#endif
+
+/*
+** Debugging utilities.
+*/
+
+typedef struct integrity_t
+{
+	int prev_status;
+	int status;
+} integrity_t;
+
+#define tlsf_insist(x) { tlsf_assert(x); if (!(x)) { status--; } }
+
+static void integrity_walker(void* ptr, size_t size, int used, void* user)
+{
+	block_header_t* block = block_from_ptr(ptr);
+	integrity_t* integ = tlsf_cast(integrity_t*, user);
+	const int this_prev_status = block_is_prev_free(block) ? 1 : 0;
+	const int this_status = block_is_free(block) ? 1 : 0;
+	const size_t this_block_size = block_size(block);
+
+	int status = 0;
+	(void)used;
+	tlsf_insist(integ->prev_status == this_prev_status && "prev status incorrect");
+	tlsf_insist(size == this_block_size && "block size incorrect");
+
+	integ->prev_status = this_status;
+	integ->status += status;
+}
+
+static int lists_check(lists_t* lists)
+{
+	int i, j;
+	int status = 0;
+#if defined (TLSF_PRIO)
+	size_t free_bytes = 0;
+#endif
+
+	/* Check that the free lists and bitmaps are accurate. */
+	for (i = 0; i < FL_INDEX_COUNT; ++i)
+	{
+		for (j = 0; j < SL_INDEX_COUNT; ++j)
+		{
+			const int fl_map = lists->fl_bitmap & (1U << i);
+			const int sl_list = lists->sl_bitmap[i];
+			const int sl_map = sl_list & (1U << j);
+			const block_header_t* block = lists->blocks[i][j];
+
+			/* Check that first- and second-level lists agree. */
+			if (!fl_map)
+			{
+				tlsf_insist(!sl_map && "second-level map must be null");
+			}
+
+			if (!sl_map)
+			{
+				tlsf_insist(block == &lists->block_null && "block list must be null");
+				continue;
+			}
+
+			/* Check that there is at least one free block. */
+			tlsf_insist(sl_list && "no free blocks in second-level map");
+			tlsf_insist(block != &lists->block_null && "block should not be null");
+
+			while (block != &lists->block_null)
+			{
+				int fli, sli;
+				tlsf_insist(block_is_free(block) && "block should be free");
+				tlsf_insist(!block_is_prev_free(block) && "blocks should have coalesced");
+				tlsf_insist(!block_is_free(block_next(block)) && "blocks should have coalesced");
+				tlsf_insist(block_is_prev_free(block_next(block)) && "block should be free");
+				tlsf_insist(block_size(block) >= block_size_min && "block not minimum size");
+
+				mapping_insert(block_size(block), &fli, &sli);
+				tlsf_insist(fli == i && sli == j && "block size indexed in wrong list");
+#if defined (TLSF_PRIO)
+				free_bytes += block_size(block);
+#endif
+				block = block->next_free;
+			}
+		}
+	}
+
+#if defined (TLSF_DEFER_COALESCE)
+	/* Check that pending blocks are still used and filed correctly. */
+	{
+		unsigned int pending = 0;
+		for (i = 0; i < DEFER_FL_COUNT; ++i)
+		{
+			for (j = 0; j < SL_INDEX_COUNT; ++j)
+			{
+				const block_header_t* block = lists->deferred[i][j];
+				const int sl_map = lists->deferred_bitmap[i] & (1U << j);
+				tlsf_insist(!sl_map == !block && "deferred bitmap disagrees with list");
+
+				while (block)
+				{
+					int fli, sli;
+					tlsf_insist(!block_is_free(block) && "deferred block should be used");
+					tlsf_insist((block->size & block_header_deferred_bit) && "deferred block not marked");
+					mapping_insert(block_size(block), &fli, &sli);
+					tlsf_insist(fli == i && sli == j && "deferred block in wrong list");
+#if defined (TLSF_PRIO)
+					free_bytes += block_size(block);
+#endif
+					block = block->next_free;
+					++pending;
+				}
+			}
+		}
+		tlsf_insist(pending == lists->deferred_count && "deferred count incorrect");
+	}
+#endif
+
+#if defined (TLSF_PRIO)
+	tlsf_insist(free_bytes == lists->free_bytes && "free byte count incorrect");
+#endif
+
+	return status;
+}
+
+int tlsf_check(tlsf_t tlsf)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	int status = 0;
+
+	control_lock(control);
+
+#if !defined (TLSF_POOL_LISTS)
+	status += lists_check(&control->lists);
+#else
+	/* Check each pool's lists and that the heap's pool masks match them. */
+	{
+		int i, fl;
+#if defined (TLSF_PRIO)
+		size_t pool_free = 0;
+#endif
+		for (i = 0; i < control->pool_count; ++i)
+		{
+			const lists_t* lists = control->pool_sorted[i];
+			status += lists_check(control->pool_sorted[i]);
+#if defined (TLSF_PRIO)
+			tlsf_insist(lists->pool_free_published == (lists->pool_draining ? 0 : lists->free_bytes)
+				&& "pool free bytes not published");
+			pool_free += lists->pool_free_published;
+#endif
+			tlsf_insist(control->pool_slots[lists->pool_slot] == lists && "pool slot incorrect");
+			tlsf_insist(lists->pool_published == (lists->pool_draining ? 0 : lists->fl_bitmap)
+				&& "pool bitmap not published");
+			tlsf_insist((i == 0 || control->pool_sorted[i - 1] < lists) && "pools not sorted");
+		}
+#if defined (TLSF_PRIO)
+		tlsf_insist(control->pool_free == pool_free && "heap free bytes incorrect");
+#endif
+		for (fl = 0; fl < FL_INDEX_COUNT; ++fl)
+		{
+			unsigned int pools = 0;
+			for (i = 0; i < control->pool_count; ++i)
+			{
+				const lists_t* lists = control->pool_sorted[i];
+				if (!lists->pool_draining && (lists->fl_bitmap & (1U << fl)))
+				{
+					pools |= 1U << lists->pool_slot;
+				}
+			}
+			tlsf_insist(control->pool_fl_map[fl] == pools && "pool mask incorrect");
+			tlsf_insist(!(control->pool_fl_bitmap & (1U << fl)) == !pools && "pool bitmap incorrect");
+		}
+	}
+#endif
+
+	control_unlock(control);
+
+	return status;
+}
+
+#undef tlsf_insist
+
+static void default_walker(void* ptr, size_t size, int used, void* user)
+{
+	(void)user;
+	printf("\t%p %s size: %x (%p)\n", ptr, used ? "used" : "free", (unsigned int)size, block_from_ptr(ptr));
+}
+
+void tlsf_walk_pool(pool_t pool, tlsf_walker walker, void* user)
+{
+	tlsf_walker pool_walker = walker ? walker : default_walker;
+	block_header_t* block =
+		offset_to_block(pool, -(int)block_header_overhead);
+
+	while (block && !block_is_last(block))
+	{
+		pool_walker(
+			block_to_ptr(block),
+			block_size(block),
+			!block_is_free(block),
+			user);
+		block = block_next(block);
+	}
+}
+
+#if defined (TLSF_TAGS)
+typedef struct tag_filter_t
+{
+	unsigned int tag;
+	tlsf_walker walker;
+	void* user;
+} tag_filter_t;
+
+static void tag_filter_walker(void* ptr, size_t size, int used, void* user)
+{
+	const tag_filter_t* filter = tlsf_cast(const tag_filter_t*, user);
+	if (used && block_tag(block_from_ptr(ptr)) == filter->tag)
+	{
+		filter->walker(ptr, size, used, filter->user);
+	}
+}
+
+void tlsf_walk_pool_tagged(pool_t pool, unsigned int tag, tlsf_walker walker, void* user)
+{
+	tag_filter_t filter;
+	filter.tag = tag;
+	filter.walker = walker ? walker : default_walker;
+	filter.user = user;
+	tlsf_walk_pool(pool, tag_filter_walker, &filter);
+}
+
+unsigned int tlsf_block_tag(void* ptr)
+{
+	return ptr ? block_tag(block_from_ptr(ptr)) : 0;
+}
+#endif
+
+/*
+** Heap maps.
+**
+** A pool is exported as one record per block, encoded as varints and
+** passed to the writer through a small buffer, so large pools cost a few
+** bytes per block and no allocation. The format is described in the
+** README; offsets are implied by the sizes, since blocks are contiguous.
+*/
+enum tlsf_export_private
+{
+	EXPORT_VERSION = 1,
+	EXPORT_BUFFER_SIZE = 256,
+	/* Longest varint of a size_t. */
+	EXPORT_VARINT_MAX = (sizeof(size_t) * CHAR_BIT + 6) / 7,
+};
+
+typedef struct export_t
+{
+	tlsf_writer writer;
+	void* user;
+	int status;
+	/* Address of the last block in a snapshot. */
+	tlsfptr_t previous;
+	size_t length;
+	unsigned char buffer[EXPORT_BUFFER_SIZE];
+} export_t;
+
+static void export_flush(export_t* out)
+{
+	if (out->length && !out->status)
+	{
+		out->status = out->writer(out->buffer, out->length, out->user);
+	}
+	out->length = 0;
+}
+
+static void export_byte(export_t* out, unsigned int value)
+{
+	if (out->length == EXPORT_BUFFER_SIZE)
+	{
+		export_flush(out);
+	}
+	out->buffer[out->length++] = tlsf_cast(unsigned char, value);
+}
+
+/* Seven bits per byte, low bits first; the high bit marks continuation. */
+static void export_varint(export_t* out, size_t value)
+{
+	if (out->length + EXPORT_VARINT_MAX > EXPORT_BUFFER_SIZE)
+	{
+		export_flush(out);
+	}
+	while (value >= 0x80)
+	{
+		out->buffer[out->length++] = tlsf_cast(unsigned char, (value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out->buffer[out->length++] = tlsf_cast(unsigned char, value);
+}
+
+static void export_walker(void* ptr, size_t size, int used, void* user)
+{
+	export_t* out = tlsf_cast(export_t*, user);
+	export_varint(out, (size / ALIGN_SIZE) << 1 | (used ? 1 : 0));
+#if defined (TLSF_TAGS)
+	export_byte(out, used ? block_tag(block_from_ptr(ptr)) : 0);
+#else
+	(void)ptr;
+#endif
+}
+
+int tlsf_export_pool(tlsf_t tlsf, pool_t pool, tlsf_writer writer, void* user)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	export_t out;
+	const char* magic = "TLSF";
+
+	out.writer = writer;
+	out.user = user;
+	out.status = 0;
+	out.previous = 0;
+	out.length = 0;
+
+	control_lock(control);
+	while (*magic)
+	{
+		export_byte(&out, *magic++);
+	}
+	export_byte(&out, EXPORT_VERSION);
+	export_byte(&out, block_header_tag_bits ? 1 : 0);
+	export_varint(&out, ALIGN_SIZE);
+	export_varint(&out, block_header_overhead);
+	export_varint(&out, tlsf_cast(size_t, pool));
+	tlsf_walk_pool(pool, export_walker, &out);
+	export_varint(&out, 0);
+	export_flush(&out);
+	control_unlock(control);
+
+	return out.status;
+}
+
+/*
+** Snapshots.
+**
+** A snapshot lists the used blocks of a pool in address order, each as
+** the distance from the previous one and its size, both in alignment
+** units, plus its tag with TLSF_TAGS. Most entries take two or three
+** bytes. Comparing two snapshots of a pool is a merge of the two lists.
+*/
+enum tlsf_snapshot_private
+{
+	SNAPSHOT_VERSION = 1,
+};
+
+typedef struct snapshot_buffer_t
+{
+	unsigned char* data;
+	size_t capacity;
+	size_t length;
+} snapshot_buffer_t;
+
+/* Copy what fits; count everything, so the caller learns the size. */
+static int snapshot_copy(const void* data, size_t bytes, void* user)
+{
+	snapshot_buffer_t* buffer = tlsf_cast(snapshot_buffer_t*, user);
+	if (buffer->length + bytes <= buffer->capacity)
+	{
+		memcpy(buffer->data + buffer->length, data, bytes);
+	}
+	buffer->length += bytes;
+	return 0;
+}
+
+static void snapshot_walker(void* ptr, size_t size, int used, void* user)
+{
+	export_t* out = tlsf_cast(export_t*, user);
+	if (used)
+	{
+		const tlsfptr_t address = tlsf_cast(tlsfptr_t, ptr);
+		export_varint(out, tlsf_cast(size_t, address - out->previous) / ALIGN_SIZE);
+		export_varint(out, size / ALIGN_SIZE);
+#if defined (TLSF_TAGS)
+		export_byte(out, block_tag(block_from_ptr(ptr)));
+#endif
+		out->previous = address;
+	}
+}
+
+size_t tlsf_snapshot_take(tlsf_t tlsf, pool_t pool, void* buffer, size_t capacity)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	snapshot_buffer_t copy;
+	export_t out;
+	const char* magic = "TLSS";
+
+	copy.data = tlsf_cast(unsigned char*, buffer);
+	copy.capacity = buffer ? capacity : 0;
+	copy.length = 0;
+	out.writer = snapshot_copy;
+	out.user = &copy;
+	out.status = 0;
+	out.previous = tlsf_cast(tlsfptr_t, pool);
+	out.length = 0;
+
+	control_lock(control);
+	while (*magic)
+	{
+		export_byte(&out, *magic++);
+	}
+	export_byte(&out, SNAPSHOT_VERSION);
+	export_byte(&out, block_header_tag_bits ? 1 : 0);
+	export_varint(&out, tlsf_cast(size_t, pool));
+	tlsf_walk_pool(pool, snapshot_walker, &out);
+	export_varint(&out, 0);
+	export_flush(&out);
+	control_unlock(control);
+
+	return copy.length;
+}
+
+typedef struct snapshot_reader_t
+{
+	const unsigned char* data;
+	size_t length;
+	size_t position;
+	int tags;
+	int status;
+	/* The current block, or a size of 0 at the end. */
+	tlsfptr_t address;
+	size_t size;
+	unsigned int tag;
+} snapshot_reader_t;
+
+static size_t snapshot_varint(snapshot_reader_t* reader)
+{
+	size_t value = 0;
+	int shift = 0;
+
+	while (reader->position < reader->length && shift < tlsf_cast(int, sizeof(size_t) * CHAR_BIT))
+	{
+		const unsigned char byte = reader->data[reader->position++];
+		value |= tlsf_cast(size_t, byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+		{
+			return value;
+		}
+		shift += 7;
+	}
+	reader->status = 1;
+	return 0;
+}
+
+/* Step to the next block; a malformed snapshot ends as if empty. */
+static void snapshot_next(snapshot_reader_t* reader)
+{
+	const size_t distance = snapshot_varint(reader);
+
+	reader->size = 0;
+	if (!distance || reader->status)
+	{
+		return;
+	}
+	reader->address += tlsf_cast(tlsfptr_t, distance * ALIGN_SIZE);
+	reader->size = snapshot_varint(reader) * ALIGN_SIZE;
+	reader->tag = 0;
+	if (reader->tags)
+	{
+		reader->tag = reader->position < reader->length ? reader->data[reader->position++] : 0;
+	}
+	if (reader->status || reader->size < block_size_min || reader->size >= block_size_max)
+	{
+		reader->status = 1;
+		reader->size = 0;
+	}
+}
+
+static void snapshot_open(snapshot_reader_t* reader, const void* snapshot, size_t bytes)
+{
+	reader->data = tlsf_cast(const unsigned char*, snapshot);
+	reader->length = bytes;
+	reader->position = 6;
+	reader->tags = 0;
+	reader->status = 1;
+	reader->address = 0;
+	reader->size = 0;
+	reader->tag = 0;
+
+	if (snapshot && bytes >= 6 && !memcmp(reader->data, "TLSS", 4)
+		&& reader->data[4] == SNAPSHOT_VERSION)
+	{
+		reader->tags = reader->data[5] & 1;
+		reader->status = 0;
+		reader->address = tlsf_cast(tlsfptr_t, snapshot_varint(reader));
+		snapshot_next(reader);
+	}
+}
+
+static void snapshot_count(tlsf_snapshot_class_t* classes, size_t size, int change)
+{
+	int fl, sl;
+	tlsf_snapshot_class_t* counts;
+
+	mapping_insert(size, &fl, &sl);
+	counts = &classes[fl];
+	if (change > 0)
+	{
+		counts->appeared++;
+		counts->appeared_bytes += size;
+	}
+	else if (change < 0)
+	{
+		counts->freed++;
+		counts->freed_bytes += size;
+	}
+	else
+	{
+		counts->persisted++;
+		counts->persisted_bytes += size;
+	}
+}
+
+int tlsf_snapshot_diff(const void* older, size_t older_bytes,
+	const void* newer, size_t newer_bytes,
+	tlsf_snapshot_reporter reporter, void* user)
+{
+	tlsf_snapshot_class_t classes[FL_INDEX_COUNT];
+	snapshot_reader_t before, after;
+	int i;
+
+	snapshot_open(&before, older, older_bytes);
+	snapshot_open(&after, newer, newer_bytes);
+	if (before.status || after.status || before.address != after.address || before.tags != after.tags)
+	{
+		return 1;
+	}
+
+	memset(classes, 0, sizeof(classes));
+	for (i = 0; i < FL_INDEX_COUNT; ++i)
+	{
+		classes[i].size_min = i ? tlsf_cast(size_t, 1) << (i + FL_INDEX_SHIFT - 1) : 0;
+		classes[i].size_max = i ? (classes[i].size_min << 1) - 1 : SMALL_BLOCK_SIZE - 1;
+	}
+
+	/* A block persists if the same address holds the same size and tag. */
+	while (before.size || after.size)
+	{
+		if (!after.size || (before.size && before.address < after.address))
+		{
+			snapshot_count(classes, before.size, -1);
+			snapshot_next(&before);
+		}
+		else if (!before.size || after.address < before.address)
+		{
+			snapshot_count(classes, after.size, 1);
+			snapshot_next(&after);
+		}
+		else
+		{
+			if (before.size == after.size && before.tag == after.tag)
+			{
+				snapshot_count(classes, after.size, 0);
+			}
+			else
+			{
+				snapshot_count(classes, before.size, -1);
+				snapshot_count(classes, after.size, 1);
+			}
+			snapshot_next(&before);
+			snapshot_next(&after);
+		}
+	}
+	if (before.status || after.status)
+	{
+		return 1;
+	}
+
+	for (i = 0; i < FL_INDEX_COUNT; ++i)
+	{
+		if (classes[i].appeared || classes[i].persisted || classes[i].freed)
+		{
+			reporter(&classes[i], user);
+		}
+	}
+	return 0;
+}
+
+size_t tlsf_block_size(void* ptr)
+{
+	size_t size = 0;
+	if (ptr)
+	{
+		const block_header_t* block = block_from_ptr(ptr);
+		size = block_size(block);
+	}
+	return size;
+}
+
+int tlsf_check_pool(pool_t pool)
+{
+	/* Check that the blocks are physically correct. */
+	integrity_t integ = { 0, 0 };
+	tlsf_walk_pool(pool, integrity_walker, &integ);
+
+	return integ.status;
+}
+
+/*
+** Size of the TLSF structures in a given memory block passed to
+** tlsf_create, equal to the size of a control_t
+*/
+size_t tlsf_size(void)
+{
+	return sizeof(control_t);
+}
+
+size_t tlsf_align_size(void)
+{
+	return ALIGN_SIZE;
+}
+
+size_t tlsf_sl_index_count(void)
+{
+	return SL_INDEX_COUNT;
+}
+
+size_t tlsf_block_size_min(void)
+{
+	return block_size_min;
+}
+
+size_t tlsf_block_size_max(void)
+{
+	return block_size_max;
+}
+
+/*
+** Overhead of the TLSF structures in a given memory block passed to
+** tlsf_add_pool, equal to the overhead of a free block and the
+** sentinel block, plus the pool's own free lists with TLSF_POOL_LISTS.
+*/
+size_t tlsf_pool_overhead(void)
+{
+	return 2 * block_header_overhead + pool_header_size;
+}
+
+size_t tlsf_alloc_overhead(void)
+{
+	return block_header_overhead;
+}
+
+unsigned long long tlsf_histogram_bucket_min(int bucket)
+{
+	if (bucket < 4)
+	{
+		return tlsf_cast(unsigned long long, bucket);
+	}
+	return tlsf_cast(unsigned long long, 4 + (bucket & 3)) << (bucket / 4 - 1);
+}
+
+pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	lists_t* lists;
+	block_header_t* block;
+	block_header_t* next;
+
+	const size_t pool_overhead = tlsf_pool_overhead();
+	const size_t pool_bytes = align_down(bytes - pool_overhead, ALIGN_SIZE);
+
+	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0)
+	{
+		printf("tlsf_add_pool: Memory must be aligned by %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return 0;
+	}
+
+	if (pool_bytes < block_size_min || pool_bytes > block_size_max)
+	{
+#if defined (TLSF_64BIT)
+		printf("tlsf_add_pool: Memory size must be between 0x%x and 0x%x00 bytes.\n", 
+			(unsigned int)(pool_overhead + block_size_min),
+			(unsigned int)((pool_overhead + block_size_max) / 256));
+#else
+		printf("tlsf_add_pool: Memory size must be between %u and %u bytes.\n", 
+			(unsigned int)(pool_overhead + block_size_min),
+			(unsigned int)(pool_overhead + block_size_max));
+#endif
+		return 0;
+	}
+
+	if (!registry_add(control, mem, bytes, tlsf_cast(char*, mem) + pool_header_size, "tlsf_add_pool"))
+	{
+		return 0;
+	}
+
+#if defined (TLSF_POOL_LISTS)
+	/* The pool's free lists come first; the blocks follow them. */
+	lists = tlsf_cast(lists_t*, mem);
+	lists_construct(lists);
+	lists->heap = control;
+	mem = tlsf_cast(char*, mem) + pool_header_size;
+#else
+	lists = &control->lists;
+#endif
+
+	/*
+	** Create the main free block. Offset the start of the block slightly
+	** so that the prev_phys_block field falls outside of the pool -
+	** it will never be used.
+	*/
+	block = offset_to_block(mem, -(tlsfptr_t)block_header_overhead);
+	block_set_size(block, pool_bytes);
+	block_set_free(block);
+	block_set_prev_used(block);
+
+	/* Split the block to create a zero-size sentinel block. */
+	next = block_link_next(block);
+	block_set_size(next, 0);
+	block_set_used(next);
+	block_set_prev_free(next);
+
+	control_lock(control);
+#if defined (TLSF_POOL_LISTS)
+	if (!pool_register(control, lists, next))
+	{
+		control_unlock(control);
+		registry_release(control, mem);
+		printf("tlsf_add_pool: A heap can hold at most %u pools.\n",
+			(unsigned int)POOL_COUNT_MAX);
+		return 0;
+	}
+#endif
+	block_insert(lists, block);
+	pool_sync(control, lists);
+	control_unlock(control);
+
+	trace_pool_add(control, mem, bytes);
+	return mem;
+}
+
+void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	lists_t* lists = pool_lists(control, pool);
+	block_header_t* block = offset_to_block(pool, -(int)block_header_overhead);
+
+	int fl = 0, sl = 0;
+
+	trace_pool_remove(control, pool);
+	control_lock(control);
+#if defined (TLSF_DEFER_COALESCE)
+	lists_coalesce(lists, DEFER_LIMIT);
+#endif
+
+	tlsf_assert(block_is_free(block) && "block should be free");
+	tlsf_assert(!block_is_free(block_next(block)) && "next block should not be free");
+	tlsf_assert(block_size(block_next(block)) == 0 && "next block size should be zero");
+
+	mapping_insert(block_size(block), &fl, &sl);
+	remove_free_block(lists, block, fl, sl);
+#if defined (TLSF_POOL_LISTS)
+	pool_unregister(control, lists);
+#endif
+	control_unlock(control);
+
+	registry_release(control, pool);
+}
+
+/*
+** Rebuild the free lists of a pool from its physical block chain. The
+** chain is validated against the pool bounds before anything is written,
+** so a pool with a damaged chain is left untouched and 0 is returned.
+** Runs of adjacent free blocks are coalesced and the prev_free bits and
+** prev_phys_block links are recomputed; used blocks are kept as they are.
+** Blocks whose free was still deferred are freed, since the lists that
+** held them do not survive the rebuild.
+*/
+static int pool_rebuild(lists_t* lists, void* mem, size_t pool_bytes)
+{
+	const block_header_t* sentinel = offset_to_block(mem, pool_bytes);
+	block_header_t* block = offset_to_block(mem, -(tlsfptr_t)block_header_overhead);
+	block_header_t* run = 0;
+
+	/* Validate the chain: every block must end inside the pool. */
+	while (block != sentinel)
+	{
+		const size_t size = block_size(block);
+		if (size < block_size_min || (size % ALIGN_SIZE) != 0
+			|| size + block_header_overhead >
+				tlsf_cast(size_t, tlsf_cast(tlsfptr_t, sentinel) - tlsf_cast(tlsfptr_t, block)))
+		{
+			return 0;
+		}
+		block = block_next(block);
+	}
+	if (!block_is_last(block))
+	{
+		return 0;
+	}
+
+	block = offset_to_block(mem, -(tlsfptr_t)block_header_overhead);
+	block_set_prev_used(block);
+	while (!block_is_last(block))
+	{
+		block_header_t* next = block_next(block);
+		if (block->size & block_header_deferred_bit)
+		{
+			block->size &= ~block_header_deferred_bit;
+			block_set_free(block);
+		}
+		if (block_is_free(block))
+		{
+			run = run ? block_absorb(run, block) : block;
+			next->prev_phys_block = run;
+			block_set_prev_free(next);
+		}
+		else
+		{
+			if (run)
+			{
+				block_insert(lists, run);
+				run = 0;
+			}
+			pool_used_add(lists, block_size(block));
+			block_set_prev_used(next);
+		}
+		block = next;
+	}
+	if (run)
+	{
+		block_insert(lists, run);
+	}
+
+	return 1;
+}
+
+pool_t tlsf_attach_pool(tlsf_t tlsf, void* mem, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	lists_t* lists;
+	const size_t pool_bytes = align_down(bytes - tlsf_pool_overhead(), ALIGN_SIZE);
+	int attached;
+
+	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0)
+	{
+		printf("tlsf_attach_pool: Memory must be aligned by %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return 0;
+	}
+
+	if (bytes < tlsf_pool_overhead() || pool_bytes < block_size_min || pool_bytes > block_size_max)
+	{
+		printf("tlsf_attach_pool: Memory size does not match any pool.\n");
+		return 0;
+	}
+
+	if (!registry_add(control, mem, bytes, tlsf_cast(char*, mem) + pool_header_size, "tlsf_attach_pool"))
+	{
+		return 0;
+	}
+
+#if defined (TLSF_POOL_LISTS)
+	lists = tlsf_cast(lists_t*, mem);
+	mem = tlsf_cast(char*, mem) + pool_header_size;
+#else
+	lists = &control->lists;
+#endif
+
+	control_lock(control);
+#if defined (TLSF_POOL_LISTS)
+	if (control->pool_count == POOL_COUNT_MAX)
+	{
+		control_unlock(control);
+		registry_release(control, mem);
+		printf("tlsf_attach_pool: A heap can hold at most %u pools.\n",
+			(unsigned int)POOL_COUNT_MAX);
+		return 0;
+	}
+	lists_construct(lists);
+	lists->heap = control;
+	attached = pool_rebuild(lists, mem, pool_bytes)
+		&& pool_register(control, lists, offset_to_block(mem, pool_bytes));
+#else
+	attached = pool_rebuild(lists, mem, pool_bytes);
+#endif
+#if defined (TLSF_TAGS)
+	if (attached)
+	{
+		tlsf_walk_pool(mem, tag_walker, control);
+	}
+#endif
+	control_unlock(control);
+
+	if (!attached)
+	{
+		registry_release(control, mem);
+		printf("tlsf_attach_pool: Block chain is damaged, pool not attached.\n");
+		return 0;
+	}
+
+	trace_pool_add(control, mem, bytes);
+	return mem;
+}
+
+/*
+** Events of the public entry points, traced outside the lock. A realloc
+** to size 0 is traced as a free beforehand, since the block is gone by
+** the time it returns.
+*/
+#if defined (TLSF_USDT) || defined (TLSF_HOOKS)
+static void trace_alloc(control_t* control, void* ptr, size_t size)
+{
+	if (ptr)
+	{
+		usdt_probe3(alloc, tlsf_cast(void*, control), ptr, size);
+		hook_call(on_alloc, (hooks_user, tlsf_cast(tlsf_t, control), ptr, size));
+	}
+	else if (size)
+	{
+		usdt_probe2(alloc_failed, tlsf_cast(void*, control), size);
+		hook_call(on_alloc_failed, (hooks_user, tlsf_cast(tlsf_t, control), size));
+	}
+}
+
+static void trace_free(control_t* control, void* ptr)
+{
+	if (ptr)
+	{
+		const size_t size = tlsf_block_size(ptr);
+		usdt_probe3(free, tlsf_cast(void*, control), ptr, size);
+		hook_call(on_free, (hooks_user, tlsf_cast(tlsf_t, control), ptr, size));
+	}
+}
+
+static void trace_realloc(control_t* control, void* ptr, void* p, size_t size)
+{
+	if (!ptr || !p)
+	{
+		trace_alloc(control, p, size);
+	}
+	else if (p != ptr)
+	{
+		usdt_probe4(realloc_move, tlsf_cast(void*, control), ptr, p, size);
+		hook_call(on_realloc_move, (hooks_user, tlsf_cast(tlsf_t, control), ptr, p, size));
+	}
+}
+#else
+#define trace_alloc(control, ptr, size) ((void)0)
+#define trace_free(control, ptr) ((void)0)
+#define trace_realloc(control, ptr, p, size) ((void)0)
+#endif
+
+/*
+** TLSF main interface.
+*/
+
+#if _DEBUG
+int test_ffs_fls()
+{
+	/* Verify ffs/fls work properly. */
+	int rv = 0;
+	rv += (tlsf_ffs(0) == -1) ? 0 : 0x1;
+	rv += (tlsf_fls(0) == -1) ? 0 : 0x2;
+	rv += (tlsf_ffs(1) == 0) ? 0 : 0x4;
+	rv += (tlsf_fls(1) == 0) ? 0 : 0x8;
+	rv += (tlsf_ffs(0x80000000) == 31) ? 0 : 0x10;
+	rv += (tlsf_ffs(0x80008000) == 15) ? 0 : 0x20;
+	rv += (tlsf_fls(0x80000008) == 31) ? 0 : 0x40;
+	rv += (tlsf_fls(0x7FFFFFFF) == 30) ? 0 : 0x80;
+
+#if defined (TLSF_64BIT)
+	rv += (tlsf_fls_sizet(0x80000000) == 31) ? 0 : 0x100;
+	rv += (tlsf_fls_sizet(0x100000000) == 32) ? 0 : 0x200;
+	rv += (tlsf_fls_sizet(0xffffffffffffffff) == 63) ? 0 : 0x400;
+#endif
+
+	/* Verify the compile-time size classes of tlsf_inline.h. */
+	{
+		int fl, sl;
+		mapping_search(adjust_request_size(1, ALIGN_SIZE), &fl, &sl);
+		rv += (TLSF_CLASS_FL(1) == fl && TLSF_CLASS_SL(1) == sl) ? 0 : 0x800;
+		mapping_search(adjust_request_size(1000, ALIGN_SIZE), &fl, &sl);
+		rv += (TLSF_CLASS_FL(1000) == fl && TLSF_CLASS_SL(1000) == sl) ? 0 : 0x1000;
+		mapping_search(adjust_request_size(1 << 20, ALIGN_SIZE), &fl, &sl);
+		rv += (TLSF_CLASS_FL(1 << 20) == fl && TLSF_CLASS_SL(1 << 20) == sl) ? 0 : 0x2000;
+	}
+
+	if (rv)
+	{
+		printf("test_ffs_fls: %x ffs/fls tests failed.\n", rv);
+	}
+	return rv;
+}
+#endif
+
+tlsf_t tlsf_create(void* mem)
+{
+#if _DEBUG
+	if (test_ffs_fls())
+	{
+		return 0;
+	}
+#endif
+
+	if (((tlsfptr_t)mem % ALIGN_SIZE) != 0)
+	{
+		printf("tlsf_create: Memory must be aligned to %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return 0;
+	}
+
+	control_construct(tlsf_cast(control_t*, mem));
+
+	return tlsf_cast(tlsf_t, mem);
+}
+
+tlsf_t tlsf_create_with_pool(void* mem, size_t bytes)
+{
+	tlsf_t tlsf = tlsf_create(mem);
+	tlsf_add_pool(tlsf, (char*)mem + tlsf_size(), bytes - tlsf_size());
+	return tlsf;
+}
+
+void tlsf_destroy(tlsf_t tlsf)
+{
+	/* Only the registry, if any, holds state outside the heap. */
+	registry_release(tlsf_cast(control_t*, tlsf), 0);
+}
+
+pool_t tlsf_get_pool(tlsf_t tlsf)
+{
+	return tlsf_cast(pool_t, (char*)tlsf + tlsf_size() + pool_header_size);
+}
+
+/*
+** Allocation primitives. The public entry points below wrap these with
+** the control lock when TLSF_LOCK is defined; internal callers such as
+** realloc use them directly so the lock is only taken once. The pool_
+** variants work on the free lists of one pool, which are the heap's own
+** unless TLSF_POOL_LISTS is defined.
+*/
+
+static void* pool_malloc(control_t* control, lists_t* lists, size_t adjust, int high)
+{
+	block_header_t* block;
+	void* p;
+
+#if defined (TLSF_DEFER_COALESCE)
+	block = block_undefer(lists, adjust);
+	if (block)
+	{
+		pool_sync(control, lists);
+		pool_used_add(lists, block_size(block));
+		return block_to_ptr(block);
+	}
+#endif
+
+	block = block_locate_free(lists, adjust);
+	p = high
+		? block_prepare_used_high(lists, block, adjust)
+		: block_prepare_used(lists, block, adjust);
+	pool_sync(control, lists);
+	pool_used_add(lists, tlsf_block_size(p));
+	return p;
+}
+
+/*
+** Size to search for when an aligned request is over-allocated. We must
+** allocate an additional minimum block size bytes so that if our free
+** block will leave an alignment gap which is smaller, we can trim a
+** leading free block and release it back to the pool. We must do this
+** because the previous physical block is in use, therefore the
+** prev_phys_block field is not valid, and we can't simply adjust the
+** size of that block.
+*/
+static size_t memalign_search_size(size_t adjust, size_t align)
+{
+	const size_t gap_minimum = sizeof(block_header_t);
+	return adjust_request_size(adjust + align + gap_minimum, align);
+}
+
+/*
+** Allocate adjust bytes aligned to align. If the block found can hold
+** keep bytes, which must be at least adjust, that much of it is kept.
+*/
+static void* pool_memalign(control_t* control, lists_t* lists,
+	size_t align, size_t adjust, size_t keep)
+{
+	const size_t gap_minimum = sizeof(block_header_t);
+	const size_t size_with_gap = memalign_search_size(adjust, align);
+	void* p;
+
+	block_header_t* block = 0;
+
+	/* This can't be a static assert. */
+	tlsf_assert(sizeof(block_header_t) == block_size_min + block_header_overhead);
+
+	/*
+	** If alignment is less than or equals base alignment, we're done.
+	** If we requested 0 bytes, return null, as tlsf_malloc(0) does.
+	** Otherwise, prefer a block that fits without the extra alignment
+	** space, and only over-allocate when none is found.
+	*/
+	if (adjust && align > ALIGN_SIZE)
+	{
+		block = block_locate_aligned(lists, adjust, align);
+		if (!block)
+		{
+			block = block_locate_free(lists, size_with_gap);
+		}
+	}
+	else
+	{
+		block = block_locate_free(lists, adjust);
+	}
+
+	if (block)
+	{
+		const size_t gap = block_align_gap(block, align);
+		if (gap)
+		{
+			tlsf_assert(gap >= gap_minimum && "gap size too small");
+			block = block_trim_free_leading(lists, block, gap);
+		}
+	}
+
+	p = block_prepare_used(lists, block,
+		block && block_size(block) >= keep ? keep : adjust);
+	pool_sync(control, lists);
+	pool_used_add(lists, tlsf_block_size(p));
+	return p;
+}
+
+/*
+** Short-lived blocks come from the high end of a free block, everything
+** else from the low end; permanent blocks also go to the lowest pool
+** that fits.
+*/
+static void* control_malloc_hint(control_t* control, size_t size, int lifetime)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	lists_t* lists;
+
+	if (mapped_wanted(control, size))
+	{
+		return mapped_alloc(size, ALIGN_SIZE);
+	}
+
+	lists = pool_select(control, adjust, lifetime == TLSF_LIFETIME_PERMANENT);
+	return lists
+		? pool_malloc(control, lists, adjust, lifetime == TLSF_LIFETIME_SHORT)
+		: 0;
+}
+
+static void* control_malloc(control_t* control, size_t size)
+{
+	return control_malloc_hint(control, size, TLSF_LIFETIME_LONG);
+}
+
+#if defined (TLSF_PRIO)
+/*
+** Allocate only if the heap keeps the priority's watermark of free bytes
+** afterwards, judged by the adjusted request size: the block found may be
+** a little larger when its remainder is too small to split off. Mapped
+** blocks do not come from the pools and are not checked.
+*/
+static void* control_malloc_prio(control_t* control, size_t size, int prio)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	const size_t watermark = control->prio_watermark[prio];
+	const size_t free_bytes = heap_free_bytes(control);
+
+	if (watermark && adjust && !mapped_wanted(control, size)
+		&& (free_bytes < adjust || free_bytes - adjust < watermark))
+	{
+		control->prio_denied[prio]++;
+		return 0;
+	}
+	return control_malloc(control, size);
+}
+#endif
+
+/*
+** Allocate adjust bytes, already adjusted, from class fl/sl as computed
+** by tlsf_inline.h. Sizes the class macros do not map exactly, mappings
+** and pool selection go through control_malloc instead, as do arguments
+** that are out of range, unadjusted or name a class below the size, which
+** would otherwise hand out a block too small.
+*/
+static void* control_malloc_class(control_t* control, size_t adjust, int fl, int sl)
+{
+#if defined (TLSF_POOL_LISTS)
+	(void)fl;
+	(void)sl;
+	return control_malloc(control, adjust);
+#else
+	block_header_t* block;
+
+	if (adjust >= block_size_max / 2 || fl < 0 || fl >= FL_INDEX_COUNT
+		|| sl < 0 || sl >= SL_INDEX_COUNT || mapping_size(fl, sl) < adjust
+		|| adjust != adjust_request_size(adjust, ALIGN_SIZE) || mapped_wanted(control, adjust))
+	{
+		return control_malloc(control, adjust);
+	}
+
+#if defined (TLSF_DEFER_COALESCE)
+	block = block_undefer(&control->lists, adjust);
+	if (block)
+	{
+		return block_to_ptr(block);
+	}
+#endif
+
+	block = block_locate_class(&control->lists, adjust, fl, sl);
+	return block_prepare_used(&control->lists, block, adjust);
+#endif
+}
+
+static void* control_memalign_keep(control_t* control, size_t align, size_t adjust, size_t keep)
+{
+	lists_t* lists = pool_search(control, align > ALIGN_SIZE
+		? memalign_search_size(adjust, align) : adjust, 0);
+
+	/* A pool may still hold an exactly sized aligned fit. */
+	if (!lists && align > ALIGN_SIZE)
+	{
+		lists = pool_search(control, adjust, 0);
+	}
+	if (!lists && adjust)
+	{
+		stats_count(control, failed_searches);
+	}
+	return lists ? pool_memalign(control, lists, align, adjust, keep) : 0;
+}
+
+static void* control_memalign(control_t* control, size_t align, size_t size)
+{
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+
+	if (mapped_wanted(control, size))
+	{
+		return mapped_alloc(size, align);
+	}
+	return control_memalign_keep(control, align, adjust, adjust);
+}
+
+/*
+** Isolated blocks start on a cache line and are rounded up to whole lines,
+** so the next block's header and data begin on a line of their own.
+** Unsplit blocks keep up to the requested size again as slack.
+*/
+static void* control_malloc_ex(control_t* control, size_t size, int flags)
+{
+	const size_t align = (flags & TLSF_MALLOC_ISOLATE)
+		? tlsf_cast(size_t, CACHE_LINE_SIZE) : tlsf_cast(size_t, ALIGN_SIZE);
+	const size_t adjust = adjust_request_size(size, align);
+	const size_t keep = (flags & TLSF_MALLOC_NO_SPLIT) && adjust < block_size_max / 2
+		? 2 * adjust : adjust;
+
+	/*
+	** Mappings are whole pages, so they are isolated and unsplit anyway.
+	** Past the largest pool block adjust is 0 and the raw size is mapped.
+	*/
+	if (mapped_wanted(control, size))
+	{
+		return mapped_alloc(adjust ? adjust : size, align);
+	}
+	return control_memalign_keep(control, align, adjust, keep);
+}
+
+static void control_free(control_t* control, void* ptr)
+{
+	/* Don't attempt to free a NULL pointer. */
+	if (ptr)
+	{
+		block_header_t* block = block_from_ptr(ptr);
+		lists_t* lists;
+
+		if (block_is_mapped(block))
+		{
+			control_untag(control, block);
+			mapped_free(block);
+			return;
+		}
+
+		lists = pool_of_block(control, block);
+		tlsf_assert(!block_is_free(block) && "block already marked as free");
+		control_untag(control, block);
+		pool_used_sub(lists, block_size(block));
+#if defined (TLSF_DEFER_COALESCE)
+		if (!block_defer(lists, block))
+#endif
+		{
+			block_release(lists, block);
+		}
+		pool_sync(control, lists);
+		pool_check_drained(control, lists);
+	}
+}
+
+/*
+** Resize a used block in place to size bytes, absorbing the next block
+** if it is free and the block must grow. The caller has checked that the
+** combined block is large enough.
+*/
+static void control_resize(control_t* control, block_header_t* block, size_t size)
+{
+	lists_t* lists = pool_of_block(control, block);
+	const size_t cursize = block_size(block);
+
+	control_untag(control, block);
+
+	/* Do we need to expand to the next block? */
+	if (size > cursize)
+	{
+		block_merge_next(lists, block);
+		block_mark_as_used(block);
+	}
+
+	/* Trim the resulting block. */
+	block_trim_used(lists, block, size);
+	pool_sync(control, lists);
+	pool_used_add(lists, block_size(block) - cursize);
+	control_tag(control, block_to_ptr(block), block_tag(block));
+}
+
+/*
+** The size a used block would have once control_resize grew it in place
+** to adjust bytes, or 0 if it cannot grow in place.
+*/
+static size_t block_grown_size(control_t* control, block_header_t* block, size_t adjust)
+{
+	const block_header_t* next = block_next(block);
+	const size_t combined = block_size(block) + block_size(next) + block_header_overhead;
+
+	if (!block_is_free(next) || adjust > combined || !pool_may_grow(control, block))
+	{
+		return 0;
+	}
+	return combined >= sizeof(block_header_t) + adjust ? adjust : combined;
+}
+
+#if defined (TLSF_MMAP)
+/*
+** Realloc of a mapped block: mremap it while it stays above the
+** threshold, otherwise (or without mremap) move it like any other block.
+*/
+static void* control_realloc_mapped(control_t* control, void* ptr, size_t size)
+{
+	block_header_t* block = block_from_ptr(ptr);
+	void* p = 0;
+
+	if (mapped_wanted(control, size))
+	{
+		control_untag(control, block);
+		p = mapped_resize(block, size, 1);
+		control_tag(control, p ? p : ptr, block_tag(block_from_ptr(p ? p : ptr)));
+	}
+
+	if (!p)
+	{
+		p = control_malloc(control, size);
+		control_tag(control, p, block_tag(block));
+		if (p)
+		{
+			stats_count(control, realloc_moves);
+			memcpy(p, ptr, tlsf_min(block_size(block), size));
+			control_free(control, ptr);
+		}
+	}
+	return p;
+}
+#endif
+
+/*
+** The TLSF block information provides us with enough information to
+** provide a reasonably intelligent implementation of realloc, growing or
+** shrinking the currently allocated block as required.
+**
+** This routine handles the somewhat esoteric edge cases of realloc:
+** - a non-zero size with a null pointer will behave like malloc
+** - a zero size with a non-null pointer will behave like free
+** - a request that cannot be satisfied will leave the original buffer
+**   untouched
+** - an extended buffer size will leave the newly-allocated area with
+**   contents undefined
+*/
+static void* control_realloc(control_t* control, void* ptr, size_t size)
+{
+	void* p = 0;
+
+	/* Zero-size requests are treated as free. */
+	if (ptr && size == 0)
+	{
+		control_free(control, ptr);
+	}
+	/* Requests with NULL pointers are treated as malloc. */
+	else if (!ptr)
+	{
+		p = control_malloc(control, size);
+		control_tag(control, p, 0);
+	}
+#if defined (TLSF_MMAP)
+	else if (block_is_mapped(block_from_ptr(ptr)))
+	{
+		p = control_realloc_mapped(control, ptr, size);
+	}
+#endif
+	else
+	{
+		block_header_t* block = block_from_ptr(ptr);
+
+		const size_t cursize = block_size(block);
+		const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+
+		tlsf_assert(!block_is_free(block) && "block already marked as free");
+
+		/*
+		** If the next block is used, or when combined with the current
+		** block, does not offer enough space, or the pool is draining, we
+		** must reallocate and copy. So too past the largest pool block,
+		** where adjust is 0, and when growing past the mmap threshold,
+		** so that huge blocks are mapped rather than kept in the pools.
+		*/
+		if (!adjust || (adjust > cursize
+			&& (mapped_wanted(control, size) || !block_grown_size(control, block, adjust))))
+		{
+			p = control_malloc(control, size);
+			control_tag(control, p, block_tag(block));
+			if (p)
+			{
+				const size_t minsize = tlsf_min(cursize, size);
+				stats_count(control, realloc_moves);
+				memcpy(p, ptr, minsize);
+				control_free(control, ptr);
+			}
+		}
+		else
+		{
+			/* Resize the block and return the original pointer. */
+			control_resize(control, block, adjust);
+			p = ptr;
+		}
+	}
+
+	return p;
+}
+
+void* tlsf_malloc(tlsf_t tlsf, size_t size)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_malloc(control, size);
+	control_tag(control, p, 0);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void* tlsf_memalign(tlsf_t tlsf, size_t align, size_t size)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_memalign(control, align, size);
+	control_tag(control, p, 0);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MEMALIGN, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void tlsf_free(tlsf_t tlsf, void* ptr)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	lists_t* drained;
+	trace_free(control, ptr);
+	control_lock(control);
+	control_free(control, ptr);
+	drained = pool_take_drained(control);
+	control_unlock(control);
+	pool_notify_drained(control, drained);
+	stats_record(control, TLSF_STAT_FREE, start);
+}
+
+void* tlsf_realloc(tlsf_t tlsf, void* ptr, size_t size)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	lists_t* drained;
+	void* p;
+	if (!size)
+	{
+		trace_free(control, ptr);
+	}
+	control_lock(control);
+	p = control_realloc(control, ptr, size);
+	drained = pool_take_drained(control);
+	control_unlock(control);
+	pool_notify_drained(control, drained);
+	stats_record(control, TLSF_STAT_REALLOC, start);
+	trace_realloc(control, ptr, p, size);
+	return p;
+}
+
+#if defined (TLSF_MMAP)
+/* Grow a mapped block in place with mremap, toward preferred bytes. */
+static size_t control_expand_mapped(control_t* control, block_header_t* block,
+	size_t min, size_t preferred)
+{
+	const size_t wanted = tlsf_max(min, preferred);
+
+	if (wanted > block_size(block))
+	{
+		control_untag(control, block);
+		if (!mapped_resize(block, wanted, 0) && min > block_size(block))
+		{
+			mapped_resize(block, min, 0);
+		}
+		control_tag(control, block_to_ptr(block), block_tag(block));
+	}
+	return block_size(block) >= min ? block_size(block) : 0;
+}
+#endif
+
+/*
+** Grow a block without moving it: toward preferred bytes as far as the
+** free space after it allows, failing if that is less than min bytes.
+*/
+static size_t control_expand(control_t* control, void* ptr, size_t min, size_t preferred)
+{
+	block_header_t* block = block_from_ptr(ptr);
+	block_header_t* next;
+	size_t cursize, available, wanted, target;
+
+#if defined (TLSF_MMAP)
+	if (block_is_mapped(block))
+	{
+		return control_expand_mapped(control, block, min, preferred);
+	}
+#endif
+
+	next = block_next(block);
+	cursize = block_size(block);
+	available = block_is_free(next) && pool_may_grow(control, block)
+		? cursize + block_size(next) + block_header_overhead
+		: cursize;
+	wanted = tlsf_max(min, preferred);
+
+	/* Anything beyond the largest block size takes all the space there is. */
+	target = wanted < block_size_max
+		? tlsf_min(adjust_request_size(wanted, ALIGN_SIZE), available)
+		: available;
+
+	tlsf_assert(!block_is_free(block) && "block already marked as free");
+
+	if (min >= block_size_max || adjust_request_size(min, ALIGN_SIZE) > available)
+	{
+		return 0;
+	}
+
+	if (target > cursize)
+	{
+		control_resize(control, block, target);
+	}
+	return block_size(block);
+}
+
+void* tlsf_malloc_class(tlsf_t tlsf, size_t size, int fl, int sl)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_malloc_class(control, size, fl, sl);
+	control_tag(control, p, 0);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void* tlsf_malloc_hint(tlsf_t tlsf, size_t size, int lifetime)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_malloc_hint(control, size, lifetime);
+	control_tag(control, p, 0);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+#if defined (TLSF_PRIO)
+void* tlsf_malloc_prio(tlsf_t tlsf, size_t size, int prio)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+
+	tlsf_assert(prio >= 0 && prio < TLSF_PRIO_COUNT && "priority out of range");
+	prio = prio < 0 ? 0 : prio < TLSF_PRIO_COUNT ? prio : TLSF_PRIO_COUNT - 1;
+
+	control_lock(control);
+	p = control_malloc_prio(control, size, prio);
+	control_tag(control, p, 0);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+#endif
+
+void* tlsf_malloc_ex(tlsf_t tlsf, size_t size, int flags)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_malloc_ex(control, size, flags);
+	control_tag(control, p, 0);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+size_t tlsf_expand(tlsf_t tlsf, void* ptr, size_t min, size_t preferred)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	size_t size = 0;
+	if (ptr)
+	{
+		control_lock(control);
+		size = control_expand(control, ptr, min, preferred);
+		control_unlock(control);
+	}
+	stats_record(control, TLSF_STAT_REALLOC, start);
+	return size;
+}
+
+void* tlsf_malloc_at_least(tlsf_t tlsf, size_t size, size_t* actual)
+{
+	void* p = tlsf_malloc(tlsf, size);
+	*actual = tlsf_block_size(p);
+	return p;
+}
+
+#if defined (TLSF_PRIO)
+void tlsf_set_prio_watermark(tlsf_t tlsf, int prio, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	tlsf_assert(prio >= 0 && prio < TLSF_PRIO_COUNT && "priority out of range");
+	if (prio >= 0 && prio < TLSF_PRIO_COUNT)
+	{
+		control_lock(control);
+		control->prio_watermark[prio] = bytes;
+		control_unlock(control);
+	}
+}
+
+unsigned long long tlsf_prio_denied(tlsf_t tlsf, int prio)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	unsigned long long denied = 0;
+	tlsf_assert(prio >= 0 && prio < TLSF_PRIO_COUNT && "priority out of range");
+	if (prio >= 0 && prio < TLSF_PRIO_COUNT)
+	{
+		control_lock(control);
+		denied = control->prio_denied[prio];
+		control_unlock(control);
+	}
+	return denied;
+}
+
+size_t tlsf_free_bytes(tlsf_t tlsf)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	size_t free_bytes;
+	control_lock(control);
+	free_bytes = heap_free_bytes(control);
+	control_unlock(control);
+	return free_bytes;
+}
+#endif
+
+#if defined (TLSF_REGISTRY)
+tlsf_t tlsf_owner(const void* ptr)
+{
+	return tlsf_cast(tlsf_t, registry_find(ptr));
+}
+
+void tlsf_free_any(void* ptr)
+{
+	if (ptr)
+	{
+		control_t* control = registry_find(ptr);
+		tlsf_assert(control && "pointer not in any registered pool");
+		if (control)
+		{
+			tlsf_free(tlsf_cast(tlsf_t, control), ptr);
+		}
+	}
+}
+#endif
+
+#if defined (TLSF_MMAP)
+void tlsf_set_mmap_threshold(tlsf_t tlsf, size_t bytes)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	control_lock(control);
+	control->mmap_threshold = bytes;
+	control_unlock(control);
+}
+#endif
+
+#if defined (TLSF_TAGS)
+void* tlsf_malloc_tagged(tlsf_t tlsf, size_t size, unsigned int tag)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_malloc(control, size);
+	control_tag(control, p, tag);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void* tlsf_memalign_tagged(tlsf_t tlsf, size_t align, size_t size, unsigned int tag)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long start = stats_now();
+	void* p;
+	control_lock(control);
+	p = control_memalign(control, align, size);
+	control_tag(control, p, tag);
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MEMALIGN, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void tlsf_tag_stats(tlsf_t tlsf, unsigned int tag, tlsf_tag_stats_t* stats)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	tlsf_assert(tag < TLSF_TAG_COUNT && "tag out of range");
+	control_lock(control);
+	*stats = control->tags[tag & (TLSF_TAG_COUNT - 1)];
+	control_unlock(control);
+}
+#endif
+
+#if defined (TLSF_POOL_LISTS)
+void* tlsf_malloc_from_pool(tlsf_t tlsf, pool_t pool, size_t size)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	const unsigned long long start = stats_now();
+	lists_t* lists = pool_lists(control, pool);
+	void* p = 0;
+	control_lock(control);
+	if (!lists->pool_draining)
+	{
+		p = pool_malloc(control, lists, adjust, 0);
+		control_tag(control, p, 0);
+	}
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MALLOC, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void* tlsf_memalign_from_pool(tlsf_t tlsf, pool_t pool, size_t align, size_t size)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
+	const unsigned long long start = stats_now();
+	lists_t* lists = pool_lists(control, pool);
+	void* p = 0;
+	control_lock(control);
+	if (!lists->pool_draining)
+	{
+		p = pool_memalign(control, lists, align, adjust, adjust);
+		control_tag(control, p, 0);
+	}
+	control_unlock(control);
+	stats_record(control, TLSF_STAT_MEMALIGN, start);
+	trace_alloc(control, p, size);
+	return p;
+}
+
+void tlsf_pool_set_draining(tlsf_t tlsf, pool_t pool, int draining)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	lists_t* lists = pool_lists(control, pool);
+	lists_t* drained;
+
+	control_lock(control);
+	lists->pool_draining = draining;
+	pool_sync(control, lists);
+	if (draining)
+	{
+		pool_check_drained(control, lists);
+	}
+	drained = pool_take_drained(control);
+	control_unlock(control);
+
+	pool_notify_drained(control, drained);
+}
+
+size_t tlsf_pool_used(tlsf_t tlsf, pool_t pool)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	size_t used;
+	control_lock(control);
+	used = pool_lists(control, pool)->pool_used;
+	control_unlock(control);
+	return used;
+}
+
+void tlsf_set_pool_drained_handler(tlsf_t tlsf, tlsf_pool_handler handler, void* user)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	control_lock(control);
+	control->pool_drained_handler = handler;
+	control->pool_drained_user = user;
+	control_unlock(control);
+}
+#endif
+
+size_t tlsf_coalesce(tlsf_t tlsf, size_t max_blocks)
+{
+	size_t pending = 0;
+#if defined (TLSF_DEFER_COALESCE)
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	control_lock(control);
+	pending = heap_coalesce(control, max_blocks);
+	control_unlock(control);
+#else
+	(void)tlsf;
+	(void)max_blocks;
+#endif
+	return pending;
+}
+
+/*
+** Regions.
+**
+** A region takes a chunk from its heap and hands out pieces of it by
+** bumping a pointer, so objects that die together are released with one
+** call instead of one free each. When the current chunk runs out, a new
+** chunk of the same size is taken; a request too large for a chunk gets
+** a chunk of its own, leaving the current one in use. Chunks after the
+** first are linked so they can be returned on reset or destroy. The region
+** header lives at the start of the first chunk.
+*/
+
+typedef struct region_chunk_t
+{
+	struct region_chunk_t* next;
+} region_chunk_t;
+
+typedef struct region_t
+{
+	tlsf_t tlsf;
+	size_t chunk_bytes;
+	/* Chunks taken after the first, newest first. */
+	region_chunk_t* chunks;
+	/* Free space in the current chunk. */
+	char* top;
+	char* end;
+	/* The first chunk's free space, restored on reset. */
+	char* base;
+	char* base_end;
+	/* Start of the latest allocation, which tlsf_region_free can undo. */
+	char* last;
+} region_t;
+
+static const size_t region_header_size =
+	(sizeof(region_t) + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+static const size_t region_chunk_header_size =
+	(sizeof(region_chunk_t) + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+
+/* Take a chunk with room for size bytes aligned to align. */
+static char* region_grow(region_t* region, size_t size, size_t align)
+{
+	const size_t limit = ~tlsf_cast(size_t, 0) - region_chunk_header_size;
+	const size_t slack = align > ALIGN_SIZE ? align - ALIGN_SIZE : 0;
+	size_t bytes;
+	int dedicated;
+	region_chunk_t* chunk;
+	char* p;
+
+	if (size > limit || slack > limit - size)
+	{
+		return 0;
+	}
+	bytes = region_chunk_header_size + slack + size;
+	dedicated = bytes > region->chunk_bytes;
+
+	chunk = tlsf_cast(region_chunk_t*,
+		tlsf_malloc(region->tlsf, dedicated ? bytes : region->chunk_bytes));
+	if (!chunk)
+	{
+		return 0;
+	}
+	chunk->next = region->chunks;
+	region->chunks = chunk;
+
+	p = tlsf_cast(char*, align_ptr(tlsf_cast(char*, chunk) + region_chunk_header_size, align));
+	if (dedicated)
+	{
+		region->last = 0;
+	}
+	else
+	{
+		region->last = p;
+		region->top = p + size;
+		region->end = tlsf_cast(char*, chunk) + tlsf_block_size(chunk);
+	}
+	return p;
+}
+
+static void* region_alloc(region_t* region, size_t size, size_t align)
+{
+	char* p;
+
+	/* Sizes this close to the top of the range would round up to 0. */
+	if (!size || size > ~tlsf_cast(size_t, 0) - ALIGN_SIZE)
+	{
+		return 0;
+	}
+	size = align_up(size, ALIGN_SIZE);
+
+	/* A large enough align wraps the aligned address below top. */
+	p = tlsf_cast(char*, align_ptr(region->top, align));
+	if (p < region->top || p > region->end || size > tlsf_cast(size_t, region->end - p))
+	{
+		return region_grow(region, size, align);
+	}
+
+	region->last = p;
+	region->top = p + size;
+	return p;
+}
+
+tlsf_region_t tlsf_region_create(tlsf_t tlsf, size_t bytes)
+{
+	const size_t chunk_bytes = region_header_size + bytes;
+	region_t* region;
+
+	if (chunk_bytes < bytes)
+	{
+		return 0;
+	}
+
+	region = tlsf_cast(region_t*, tlsf_malloc(tlsf, chunk_bytes));
+	if (!region)
+	{
+		return 0;
+	}
+
+	region->tlsf = tlsf;
+	region->chunk_bytes = chunk_bytes;
+	region->chunks = 0;
+	region->base = tlsf_cast(char*, region) + region_header_size;
+	region->base_end = tlsf_cast(char*, region) + tlsf_block_size(region);
+	region->top = region->base;
+	region->end = region->base_end;
+	region->last = 0;
+	return tlsf_cast(tlsf_region_t, region);
+}
+
+void* tlsf_region_malloc(tlsf_region_t region, size_t size)
+{
+	return region_alloc(tlsf_cast(region_t*, region), size, ALIGN_SIZE);
+}
+
+void* tlsf_region_memalign(tlsf_region_t region, size_t align, size_t size)
+{
+	return region_alloc(tlsf_cast(region_t*, region), size, tlsf_max(align, tlsf_cast(size_t, ALIGN_SIZE)));
+}
+
+void tlsf_region_free(tlsf_region_t tlsf_region, void* ptr)
+{
+	region_t* region = tlsf_cast(region_t*, tlsf_region);
+
+	/* Only the latest allocation can be taken back; others wait for reset. */
+	if (ptr && ptr == region->last)
+	{
+		region->top = region->last;
+		region->last = 0;
+	}
+}
+
+void tlsf_region_reset(tlsf_region_t tlsf_region)
+{
+	region_t* region = tlsf_cast(region_t*, tlsf_region);
+
+	while (region->chunks)
+	{
+		region_chunk_t* chunk = region->chunks;
+		region->chunks = chunk->next;
+		tlsf_free(region->tlsf, chunk);
+	}
+
+	region->top = region->base;
+	region->end = region->base_end;
+	region->last = 0;
+}
+
+void tlsf_region_destroy(tlsf_region_t tlsf_region)
+{
+	region_t* region = tlsf_cast(region_t*, tlsf_region);
+
+	if (region)
+	{
+		tlsf_region_reset(tlsf_region);
+		tlsf_free(region->tlsf, region);
+	}
+}
+
+/*
+** Child heaps.
+**
+** A child heap is a heap of its own whose pools are chunks borrowed from
+** a parent heap. It keeps the bytes in its live blocks in one counter and
+** refuses any allocation that would take that past its quota. When a
+** free empties a chunk, the chunk goes back to the parent unless it is
+** the last one. Chunks are kept sorted by address, so a free finds its
+** chunk by binary search. The child header and its heap's control
+** structure share one block of the parent.
+*/
+
+typedef struct child_chunk_t
+{
+	char* start;
+	char* end;
+	pool_t pool;
+	/* Bytes in live blocks. */
+	size_t used;
+} child_chunk_t;
+
+typedef struct child_t
+{
+	tlsf_t parent;
+	tlsf_t heap;
+	size_t chunk_bytes;
+	size_t quota;
+	/* Bytes in live blocks, and bytes borrowed from the parent. */
+	size_t used;
+	size_t borrowed;
+	child_chunk_t* chunks;
+	int chunk_count;
+	int chunk_capacity;
+} child_t;
+
+static const size_t child_header_size =
+	(sizeof(child_t) + ALIGN_SIZE - 1) & ~(ALIGN_SIZE - 1);
+
+#define child_fits(child, size) \
+	((child)->used <= (child)->quota && (size) <= (child)->quota - (child)->used)
+
+static child_chunk_t* child_chunk_of(child_t* child, const void* ptr)
+{
+	const char* p = tlsf_cast(const char*, ptr);
+	int lo = 0, hi = child->chunk_count;
+
+	while (lo < hi)
+	{
+		const int mid = (lo + hi) / 2;
+		if (p < child->chunks[mid].start)
+		{
+			hi = mid;
+		}
+		else if (p >= child->chunks[mid].end)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			return &child->chunks[mid];
+		}
+	}
+
+	tlsf_assert(0 && "block not in child heap");
+	return 0;
+}
+
+/* Borrow a chunk from the parent with room for a block of size bytes. */
+static int child_grow(child_t* child, size_t size)
+{
+	/* Searches round up to the next size class, see tlsf_preload.c. */
+	const size_t need = size + size / 8 + tlsf_pool_overhead() + tlsf_alloc_overhead();
+	char* mem;
+	size_t bytes;
+	pool_t pool;
+	int i;
+
+	if (need < size)
+	{
+		return 0;
+	}
+
+	if (child->chunk_count == child->chunk_capacity)
+	{
+		const int capacity = child->chunk_capacity ? 2 * child->chunk_capacity : 8;
+		child_chunk_t* chunks = tlsf_cast(child_chunk_t*, tlsf_realloc(child->parent,
+			child->chunks, capacity * sizeof(child_chunk_t)));
+		if (!chunks)
+		{
+			return 0;
+		}
+		child->chunks = chunks;
+		child->chunk_capacity = capacity;
+	}
+
+	mem = tlsf_cast(char*, tlsf_malloc(child->parent, tlsf_max(need, child->chunk_bytes)));
+	if (!mem)
+	{
+		return 0;
+	}
+	bytes = tlsf_block_size(mem);
+	pool = tlsf_add_pool(child->heap, mem, bytes);
+	if (!pool)
+	{
+		tlsf_free(child->parent, mem);
+		return 0;
+	}
+
+	for (i = child->chunk_count; i > 0 && child->chunks[i - 1].start > mem; --i)
+	{
+		child->chunks[i] = child->chunks[i - 1];
+	}
+	child->chunks[i].start = mem;
+	child->chunks[i].end = mem + bytes;
+	child->chunks[i].pool = pool;
+	child->chunks[i].used = 0;
+	++child->chunk_count;
+	child->borrowed += bytes;
+	return 1;
+}
+
+/* Return an empty chunk to the parent, unless it is the last one. */
+static void child_shrink(child_t* child, child_chunk_t* chunk)
+{
+	const int index = tlsf_cast(int, chunk - child->chunks);
+
+	if (chunk->used || child->chunk_count == 1)
+	{
+		return;
+	}
+
+	/* Deferred frees must be merged before the pool is one free block. */
+	tlsf_coalesce(child->heap, ~tlsf_cast(size_t, 0));
+	tlsf_remove_pool(child->heap, chunk->pool);
+	tlsf_free(child->parent, chunk->start);
+	child->borrowed -= tlsf_cast(size_t, chunk->end - chunk->start);
+
+	memmove(chunk, chunk + 1, (child->chunk_count - index - 1) * sizeof(child_chunk_t));
+	--child->chunk_count;
+}
+
+static void child_count(child_t* child, void* ptr)
+{
+	const size_t size = tlsf_block_size(ptr);
+	child->used += size;
+	child_chunk_of(child, ptr)->used += size;
+}
+
+static void child_free_block(child_t* child, void* ptr)
+{
+	child_chunk_t* chunk = child_chunk_of(child, ptr);
+	const size_t size = tlsf_block_size(ptr);
+
+	tlsf_free(child->heap, ptr);
+	child->used -= size;
+	chunk->used -= size;
+	child_shrink(child, chunk);
+}
+
+static void* child_alloc(child_t* child, size_t align, size_t size)
+{
+	void* p;
+
+	if (!size || !child_fits(child, size))
+	{
+		return 0;
+	}
+
+	p = align ? tlsf_memalign(child->heap, align, size) : tlsf_malloc(child->heap, size);
+	if (!p && child_grow(child, align ? size + align + sizeof(block_header_t) : size))
+	{
+		p = align ? tlsf_memalign(child->heap, align, size) : tlsf_malloc(child->heap, size);
+	}
+
+	/* The block may be a little larger than asked for. */
+	if (p)
+	{
+		child_count(child, p);
+		if (child->used > child->quota)
+		{
+			child_free_block(child, p);
+			p = 0;
+		}
+	}
+	return p;
+}
+
+tlsf_child_t tlsf_child_create(tlsf_t parent, size_t chunk_bytes, size_t quota)
+{
+	child_t* child = tlsf_cast(child_t*, tlsf_malloc(parent, child_header_size + tlsf_size()));
+
+	if (!child)
+	{
+		return 0;
+	}
+
+	child->parent = parent;
+	child->heap = tlsf_create(tlsf_cast(char*, child) + child_header_size);
+	child->chunk_bytes = chunk_bytes;
+	child->quota = quota;
+	child->used = 0;
+	child->borrowed = 0;
+	child->chunks = 0;
+	child->chunk_count = 0;
+	child->chunk_capacity = 0;
+#if defined (TLSF_MMAP)
+	/* Every block must come from a chunk. */
+	tlsf_set_mmap_threshold(child->heap, 0);
+#endif
+	return tlsf_cast(tlsf_child_t, child);
+}
+
+void tlsf_child_destroy(tlsf_child_t tlsf_child)
+{
+	child_t* child = tlsf_cast(child_t*, tlsf_child);
+	int i;
+
+	if (child)
+	{
+		tlsf_destroy(child->heap);
+		for (i = 0; i < child->chunk_count; ++i)
+		{
+			tlsf_free(child->parent, child->chunks[i].start);
+		}
+		tlsf_free(child->parent, child->chunks);
+		tlsf_free(child->parent, child);
+	}
+}
+
+void* tlsf_child_malloc(tlsf_child_t child, size_t size)
+{
+	return child_alloc(tlsf_cast(child_t*, child), 0, size);
+}
+
+void* tlsf_child_memalign(tlsf_child_t child, size_t align, size_t size)
+{
+	return child_alloc(tlsf_cast(child_t*, child), align, size);
+}
+
+void* tlsf_child_realloc(tlsf_child_t tlsf_child, void* ptr, size_t size)
+{
+	child_t* child = tlsf_cast(child_t*, tlsf_child);
+	child_chunk_t* chunk;
+	size_t cursize, adjust, grown;
+	void* p;
+
+	if (!ptr)
+	{
+		return child_alloc(child, 0, size);
+	}
+	if (!size)
+	{
+		child_free_block(child, ptr);
+		return 0;
+	}
+
+	cursize = tlsf_block_size(ptr);
+	adjust = adjust_request_size(size, ALIGN_SIZE);
+	if (!adjust)
+	{
+		return 0;
+	}
+
+	/* Shrinking and growing in place keep the block, so charge the change. */
+	grown = adjust > cursize
+		? block_grown_size(tlsf_cast(control_t*, child->heap), block_from_ptr(ptr), adjust)
+		: adjust;
+	if (grown)
+	{
+		if (grown > cursize && !child_fits(child, grown - cursize))
+		{
+			return 0;
+		}
+		chunk = child_chunk_of(child, ptr);
+		p = tlsf_realloc(child->heap, ptr, size);
+		tlsf_assert(p == ptr && "in-place resize moved the block");
+		child->used -= cursize;
+		chunk->used -= cursize;
+		child_count(child, p);
+		return p;
+	}
+
+	/*
+	** Move the block, to a new chunk if need be. The new block is charged
+	** as the old one is released, and it may be a little larger than asked.
+	*/
+	p = tlsf_malloc(child->heap, size);
+	if (!p && child_grow(child, size))
+	{
+		p = tlsf_malloc(child->heap, size);
+	}
+	if (p)
+	{
+		child_count(child, p);
+		if (child->used - cursize > child->quota)
+		{
+			child_free_block(child, p);
+			return 0;
+		}
+		memcpy(p, ptr, tlsf_min(cursize, size));
+		child_free_block(child, ptr);
+	}
+	return p;
+}
+
+void tlsf_child_free(tlsf_child_t child, void* ptr)
+{
+	if (ptr)
+	{
+		child_free_block(tlsf_cast(child_t*, child), ptr);
+	}
 }
 
-size_t tlsf_block_size_max(void)
+size_t tlsf_child_used(tlsf_child_t child)
 {
-	return block_size_max;
+	return tlsf_cast(child_t*, child)->used;
 }
 
-/*
-** Overhead of the TLSF structures in a given memory block passed to
-** tlsf_add_pool, equal to the overhead of a free block and the
-** sentinel block.
-*/
-size_t tlsf_pool_overhead(void)
+size_t tlsf_child_borrowed(tlsf_child_t child)
 {
-	return 2 * block_header_overhead;
+	return tlsf_cast(child_t*, child)->borrowed;
 }
 
-size_t tlsf_alloc_overhead(void)
+void tlsf_child_set_quota(tlsf_child_t child, size_t quota)
 {
-	return block_header_overhead;
+	tlsf_cast(child_t*, child)->quota = quota;
 }
 
-pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes)
+#if defined (TLSF_STATS)
+/* Counters are read one at a time; the snapshot is not atomic as a whole. */
+void tlsf_stats(tlsf_t tlsf, tlsf_stats_t* stats)
 {
-	block_header_t* block;
-	block_header_t* next;
-
-	const size_t pool_overhead = tlsf_pool_overhead();
-	const size_t pool_bytes = align_down(bytes - pool_overhead, ALIGN_SIZE);
+	const control_t* control = tlsf_cast(control_t*, tlsf);
+	const unsigned long long* src = tlsf_cast(const unsigned long long*, &control->stats);
+	unsigned long long* dst = tlsf_cast(unsigned long long*, stats);
+	size_t i;
 
-	if (((ptrdiff_t)mem % ALIGN_SIZE) != 0)
+	for (i = 0; i < sizeof(tlsf_stats_t) / sizeof(unsigned long long); ++i)
 	{
-		printf("tlsf_add_pool: Memory must be aligned by %u bytes.\n",
-			(unsigned int)ALIGN_SIZE);
-		return 0;
+		dst[i] = stats_load(src[i]);
 	}
+}
 
-	if (pool_bytes < block_size_min || pool_bytes > block_size_max)
+static void stats_clear(tlsf_stats_t* stats)
+{
+	unsigned long long* counters = tlsf_cast(unsigned long long*, stats);
+	size_t i;
+
+	for (i = 0; i < sizeof(tlsf_stats_t) / sizeof(unsigned long long); ++i)
 	{
-#if defined (TLSF_64BIT)
-		printf("tlsf_add_pool: Memory size must be between 0x%x and 0x%x00 bytes.\n", 
-			(unsigned int)(pool_overhead + block_size_min),
-			(unsigned int)((pool_overhead + block_size_max) / 256));
+#if defined (__GNUC__)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
 #else
-		printf("tlsf_add_pool: Memory size must be between %u and %u bytes.\n", 
-			(unsigned int)(pool_overhead + block_size_min),
-			(unsigned int)(pool_overhead + block_size_max));
+		counters[i] = 0;
 #endif
-		return 0;
 	}
+}
 
-	/*
-	** Create the main free block. Offset the start of the block slightly
-	** so that the prev_phys_block field falls outside of the pool -
-	** it will never be used.
-	*/
-	block = offset_to_block(mem, -(tlsfptr_t)block_header_overhead);
-	block_set_size(block, pool_bytes);
-	block_set_free(block);
-	block_set_prev_used(block);
-	block_insert(tlsf_cast(control_t*, tlsf), block);
+void tlsf_stats_reset(tlsf_t tlsf)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	stats_clear(&control->stats);
+}
+#endif
 
-	/* Split the block to create a zero-size sentinel block. */
-	next = block_link_next(block);
-	block_set_size(next, 0);
-	block_set_used(next);
-	block_set_prev_free(next);
+#if defined (TLSF_HOOKS)
+void tlsf_set_hooks(const tlsf_hooks_t* hooks, void* user)
+{
+	hooks_table = hooks;
+	hooks_user = user;
+}
+#endif
 
-	return mem;
+#if defined (TLSF_STATS) || defined (TLSF_PROFILE)
+void tlsf_set_counter(tlsf_counter counter, void* user)
+{
+	counter_source = counter;
+	counter_user = user;
 }
+#endif
 
-void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
+#if defined (TLSF_PROFILE)
+void tlsf_profile(tlsf_t tlsf, tlsf_profile_t* profile)
 {
 	control_t* control = tlsf_cast(control_t*, tlsf);
-	block_header_t* block = offset_to_block(pool, -(int)block_header_overhead);
+	control_lock(control);
+	*profile = control->profile;
+	control_unlock(control);
+}
 
-	int fl = 0, sl = 0;
+void tlsf_profile_reset(tlsf_t tlsf)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	control_lock(control);
+	memset(&control->profile, 0, sizeof(control->profile));
+	control_unlock(control);
+}
+#endif
 
-	tlsf_assert(block_is_free(block) && "block should be free");
-	tlsf_assert(!block_is_free(block_next(block)) && "next block should not be free");
-	tlsf_assert(block_size(block_next(block)) == 0 && "next block size should be zero");
+#if defined (TLSF_LOCK)
+void tlsf_lock_stats(tlsf_t tlsf, tlsf_lock_stats_t* stats)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	control_lock(control);
+	*stats = control->lock.stats;
+	control_unlock(control);
+}
 
-	mapping_insert(block_size(block), &fl, &sl);
-	remove_free_block(control, block, fl, sl);
+void tlsf_lock_stats_reset(tlsf_t tlsf)
+{
+	control_t* control = tlsf_cast(control_t*, tlsf);
+	control_lock(control);
+	memset(&control->lock.stats, 0, sizeof(control->lock.stats));
+	control_unlock(control);
 }
+#endif
 
+#if defined (TLSF_SHARED)
 /*
-** TLSF main interface.
+** Process-shared heaps.
+**
+** A shared heap lives entirely inside one memory segment (for example a
+** memfd or shm_open mapping) laid out as a shared_t header, the control
+** structure and a single pool. Access is serialized by a robust,
+** process-shared mutex stored in the header. If a process dies while it
+** holds the lock, the next locker rebuilds the free lists from the
+** physical block chain before continuing; blocks the dead process was in
+** the middle of allocating or freeing end up free, and everything else
+** is kept. With TLSF_DEFER_COALESCE, blocks whose free was deferred carry
+** their own status bit and are freed by the rebuild as well, so each
+** recovery does not leak up to DEFER_LIMIT pending blocks.
+**
+** The heap stores absolute pointers, so every process must map the
+** segment at the address it was created at (map it before fork, or use
+** MAP_FIXED at the recorded address).
 */
 
-#if _DEBUG
-int test_ffs_fls()
+#define TLSF_SHARED_MAGIC 0x746c7366
+
+typedef struct shared_t
 {
-	/* Verify ffs/fls work properly. */
-	int rv = 0;
-	rv += (tlsf_ffs(0) == -1) ? 0 : 0x1;
-	rv += (tlsf_fls(0) == -1) ? 0 : 0x2;
-	rv += (tlsf_ffs(1) == 0) ? 0 : 0x4;
-	rv += (tlsf_fls(1) == 0) ? 0 : 0x8;
-	rv += (tlsf_ffs(0x80000000) == 31) ? 0 : 0x10;
-	rv += (tlsf_ffs(0x80008000) == 15) ? 0 : 0x20;
-	rv += (tlsf_fls(0x80000008) == 31) ? 0 : 0x40;
-	rv += (tlsf_fls(0x7FFFFFFF) == 30) ? 0 : 0x80;
+	unsigned int magic;
+	void* base;
+	void* pool;
+	size_t pool_bytes;
+	pthread_mutex_t mutex;
+} shared_t;
+
+static control_t* shared_control(shared_t* shared)
+{
+	return tlsf_cast(control_t*, align_ptr(shared + 1, ALIGN_SIZE));
+}
 
-#if defined (TLSF_64BIT)
-	rv += (tlsf_fls_sizet(0x80000000) == 31) ? 0 : 0x100;
-	rv += (tlsf_fls_sizet(0x100000000) == 32) ? 0 : 0x200;
-	rv += (tlsf_fls_sizet(0xffffffffffffffff) == 63) ? 0 : 0x400;
-#endif
+size_t tlsf_shared_size(void)
+{
+	return align_up(sizeof(shared_t), ALIGN_SIZE) + tlsf_size();
+}
 
-	if (rv)
+tlsf_shared_t tlsf_shared_create(void* mem, size_t bytes)
+{
+	shared_t* shared = tlsf_cast(shared_t*, mem);
+	pthread_mutexattr_t attr;
+	tlsf_t tlsf;
+
+	if (((tlsfptr_t)mem % ALIGN_SIZE) != 0)
 	{
-		printf("test_ffs_fls: %x ffs/fls tests failed.\n", rv);
+		printf("tlsf_shared_create: Memory must be aligned to %u bytes.\n",
+			(unsigned int)ALIGN_SIZE);
+		return 0;
 	}
-	return rv;
-}
-#endif
 
-tlsf_t tlsf_create(void* mem)
-{
-#if _DEBUG
-	if (test_ffs_fls())
+	if (bytes < tlsf_shared_size() + tlsf_pool_overhead() + block_size_min)
 	{
+		printf("tlsf_shared_create: Memory size must be at least %u bytes.\n",
+			(unsigned int)(tlsf_shared_size() + tlsf_pool_overhead() + block_size_min));
 		return 0;
 	}
-#endif
 
-	if (((tlsfptr_t)mem % ALIGN_SIZE) != 0)
+	if (pthread_mutexattr_init(&attr) != 0)
 	{
-		printf("tlsf_create: Memory must be aligned to %u bytes.\n",
-			(unsigned int)ALIGN_SIZE);
 		return 0;
 	}
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (pthread_mutex_init(&shared->mutex, &attr) != 0)
+	{
+		pthread_mutexattr_destroy(&attr);
+		printf("tlsf_shared_create: Unable to create process-shared mutex.\n");
+		return 0;
+	}
+	pthread_mutexattr_destroy(&attr);
 
-	control_construct(tlsf_cast(control_t*, mem));
+	tlsf = tlsf_create(shared_control(shared));
+	if (!tlsf)
+	{
+		pthread_mutex_destroy(&shared->mutex);
+		return 0;
+	}
+#if defined (TLSF_MMAP)
+	/* Private mappings are invisible to the other processes. */
+	tlsf_set_mmap_threshold(tlsf, 0);
+#endif
+	shared->pool = tlsf_cast(char*, tlsf) + tlsf_size();
+	shared->pool_bytes = bytes - tlsf_shared_size();
+	if (!tlsf_add_pool(tlsf, shared->pool, shared->pool_bytes))
+	{
+		pthread_mutex_destroy(&shared->mutex);
+		return 0;
+	}
 
-	return tlsf_cast(tlsf_t, mem);
+	shared->base = mem;
+	shared->magic = TLSF_SHARED_MAGIC;
+	return tlsf_cast(tlsf_shared_t, shared);
 }
 
-tlsf_t tlsf_create_with_pool(void* mem, size_t bytes)
+tlsf_shared_t tlsf_shared_attach(void* mem)
 {
-	tlsf_t tlsf = tlsf_create(mem);
-	tlsf_add_pool(tlsf, (char*)mem + tlsf_size(), bytes - tlsf_size());
-	return tlsf;
-}
+	shared_t* shared = tlsf_cast(shared_t*, mem);
 
-void tlsf_destroy(tlsf_t tlsf)
-{
-	/* Nothing to do. */
-	(void)tlsf;
-}
+	if (shared->magic != TLSF_SHARED_MAGIC)
+	{
+		printf("tlsf_shared_attach: Memory does not contain a shared heap.\n");
+		return 0;
+	}
 
-pool_t tlsf_get_pool(tlsf_t tlsf)
-{
-	return tlsf_cast(pool_t, (char*)tlsf + tlsf_size());
+	if (shared->base != mem)
+	{
+		printf("tlsf_shared_attach: Memory must be mapped at %p.\n", shared->base);
+		return 0;
+	}
+
+	return tlsf_cast(tlsf_shared_t, shared);
 }
 
-void* tlsf_malloc(tlsf_t tlsf, size_t size)
+/*
+** Rebuild the control structure after a lock holder died. The physical
+** block chain is the only state trusted; the free lists and bitmaps are
+** reconstructed from it.
+*/
+static int shared_recover(shared_t* shared)
 {
-	control_t* control = tlsf_cast(control_t*, tlsf);
-	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
-	block_header_t* block = block_locate_free(control, adjust);
-	return block_prepare_used(control, block, adjust);
+	control_t* control = shared_control(shared);
+	registry_release(control, 0);
+	control_construct(control);
+#if defined (TLSF_MMAP)
+	control->mmap_threshold = 0;
+#endif
+	return tlsf_attach_pool(tlsf_cast(tlsf_t, control), shared->pool, shared->pool_bytes) != 0;
 }
 
-void* tlsf_memalign(tlsf_t tlsf, size_t align, size_t size)
+tlsf_t tlsf_shared_lock(tlsf_shared_t tlsf_shared)
 {
-	control_t* control = tlsf_cast(control_t*, tlsf);
-	const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
-
-	/*
-	** We must allocate an additional minimum block size bytes so that if
-	** our free block will leave an alignment gap which is smaller, we can
-	** trim a leading free block and release it back to the pool. We must
-	** do this because the previous physical block is in use, therefore
-	** the prev_phys_block field is not valid, and we can't simply adjust
-	** the size of that block.
-	*/
-	const size_t gap_minimum = sizeof(block_header_t);
-	const size_t size_with_gap = adjust_request_size(adjust + align + gap_minimum, align);
-
-	/*
-	** If alignment is less than or equals base alignment, we're done.
-	** If we requested 0 bytes, return null, as tlsf_malloc(0) does.
-	*/
-	const size_t aligned_size = (adjust && align > ALIGN_SIZE) ? size_with_gap : adjust;
+	shared_t* shared = tlsf_cast(shared_t*, tlsf_shared);
+	const int rv = pthread_mutex_lock(&shared->mutex);
 
-	block_header_t* block = block_locate_free(control, aligned_size);
-
-	/* This can't be a static assert. */
-	tlsf_assert(sizeof(block_header_t) == block_size_min + block_header_overhead);
-
-	if (block)
+	if (rv == EOWNERDEAD)
 	{
-		void* ptr = block_to_ptr(block);
-		void* aligned = align_ptr(ptr, align);
-		size_t gap = tlsf_cast(size_t,
-			tlsf_cast(tlsfptr_t, aligned) - tlsf_cast(tlsfptr_t, ptr));
-
-		/* If gap size is too small, offset to next aligned boundary. */
-		if (gap && gap < gap_minimum)
-		{
-			const size_t gap_remain = gap_minimum - gap;
-			const size_t offset = tlsf_max(gap_remain, align);
-			const void* next_aligned = tlsf_cast(void*,
-				tlsf_cast(tlsfptr_t, aligned) + offset);
-
-			aligned = align_ptr(next_aligned, align);
-			gap = tlsf_cast(size_t,
-				tlsf_cast(tlsfptr_t, aligned) - tlsf_cast(tlsfptr_t, ptr));
-		}
-
-		if (gap)
+		if (!shared_recover(shared))
 		{
-			tlsf_assert(gap >= gap_minimum && "gap size too small");
-			block = block_trim_free_leading(control, block, gap);
+			/* Unlocking without marking consistent poisons the mutex. */
+			printf("tlsf_shared_lock: Heap damaged by a dead lock holder, not recoverable.\n");
+			pthread_mutex_unlock(&shared->mutex);
+			return 0;
 		}
+		pthread_mutex_consistent(&shared->mutex);
+	}
+	else if (rv != 0)
+	{
+		return 0;
 	}
 
-	return block_prepare_used(control, block, adjust);
+	return tlsf_cast(tlsf_t, shared_control(shared));
 }
 
-void tlsf_free(tlsf_t tlsf, void* ptr)
+void tlsf_shared_unlock(tlsf_shared_t tlsf_shared)
 {
-	/* Don't attempt to free a NULL pointer. */
-	if (ptr)
+	shared_t* shared = tlsf_cast(shared_t*, tlsf_shared);
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+void* tlsf_shared_malloc(tlsf_shared_t shared, size_t size)
+{
+	void* p = 0;
+	tlsf_t tlsf = tlsf_shared_lock(shared);
+	if (tlsf)
 	{
-		control_t* control = tlsf_cast(control_t*, tlsf);
-		block_header_t* block = block_from_ptr(ptr);
-		tlsf_assert(!block_is_free(block) && "block already marked as free");
-		block_mark_as_free(block);
-		block = block_merge_prev(control, block);
-		block = block_merge_next(control, block);
-		block_insert(control, block);
+		p = tlsf_malloc(tlsf, size);
+		tlsf_shared_unlock(shared);
 	}
+	return p;
 }
 
-/*
-** The TLSF block information provides us with enough information to
-** provide a reasonably intelligent implementation of realloc, growing or
-** shrinking the currently allocated block as required.
-**
-** This routine handles the somewhat esoteric edge cases of realloc:
-** - a non-zero size with a null pointer will behave like malloc
-** - a zero size with a non-null pointer will behave like free
-** - a request that cannot be satisfied will leave the original buffer
-**   untouched
-** - an extended buffer size will leave the newly-allocated area with
-**   contents undefined
-*/
-void* tlsf_realloc(tlsf_t tlsf, void* ptr, size_t size)
+void* tlsf_shared_memalign(tlsf_shared_t shared, size_t align, size_t size)
 {
-	control_t* control = tlsf_cast(control_t*, tlsf);
 	void* p = 0;
-
-	/* Zero-size requests are treated as free. */
-	if (ptr && size == 0)
+	tlsf_t tlsf = tlsf_shared_lock(shared);
+	if (tlsf)
 	{
-		tlsf_free(tlsf, ptr);
+		p = tlsf_memalign(tlsf, align, size);
+		tlsf_shared_unlock(shared);
 	}
-	/* Requests with NULL pointers are treated as malloc. */
-	else if (!ptr)
+	return p;
+}
+
+void* tlsf_shared_realloc(tlsf_shared_t shared, void* ptr, size_t size)
+{
+	void* p = 0;
+	tlsf_t tlsf = tlsf_shared_lock(shared);
+	if (tlsf)
 	{
-		p = tlsf_malloc(tlsf, size);
+		p = tlsf_realloc(tlsf, ptr, size);
+		tlsf_shared_unlock(shared);
 	}
-	else
-	{
-		block_header_t* block = block_from_ptr(ptr);
-		block_header_t* next = block_next(block);
-
-		const size_t cursize = block_size(block);
-		const size_t combined = cursize + block_size(next) + block_header_overhead;
-		const size_t adjust = adjust_request_size(size, ALIGN_SIZE);
-
-		tlsf_assert(!block_is_free(block) && "block already marked as free");
-
-		/*
-		** If the next block is used, or when combined with the current
-		** block, does not offer enough space, we must reallocate and copy.
-		*/
-		if (adjust > cursize && (!block_is_free(next) || adjust > combined))
-		{
-			p = tlsf_malloc(tlsf, size);
-			if (p)
-			{
-				const size_t minsize = tlsf_min(cursize, size);
-				memcpy(p, ptr, minsize);
-				tlsf_free(tlsf, ptr);
-			}
-		}
-		else
-		{
-			/* Do we need to expand to the next block? */
-			if (adjust > cursize)
-			{
-				block_merge_next(control, block);
-				block_mark_as_used(block);
-			}
+	return p;
+}
 
-			/* Trim the resulting block and return the original pointer. */
-			block_trim_used(control, block, adjust);
-			p = ptr;
-		}
+void tlsf_shared_free(tlsf_shared_t shared, void* ptr)
+{
+	tlsf_t tlsf = tlsf_shared_lock(shared);
+	if (tlsf)
+	{
+		tlsf_free(tlsf, ptr);
+		tlsf_shared_unlock(shared);
 	}
-
-	return p;
 }
+#endif
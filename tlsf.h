@@ -58,6 +58,13 @@ pool_t tlsf_get_pool(tlsf_t tlsf);
 /* Add/remove memory pools. */
 pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
+/*
+** Attach a pool that already holds blocks, e.g. memory preserved across
+** a restart; mem and bytes must match the original tlsf_add_pool call.
+** Used blocks are kept and free blocks rejoin this heap's free lists,
+** as do blocks whose free was still deferred (TLSF_DEFER_COALESCE).
+*/
+pool_t tlsf_attach_pool(tlsf_t tlsf, void* mem, size_t bytes);
 
 /* malloc/memalign/realloc/free replacements. */
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
@@ -65,12 +72,174 @@ void* tlsf_memalign(tlsf_t tlsf, size_t align, size_t bytes);
 void* tlsf_realloc(tlsf_t tlsf, void* ptr, size_t size);
 void tlsf_free(tlsf_t tlsf, void* ptr);
 
+/*
+** Size-feedback variants. tlsf_expand grows a block in place toward
+** preferred bytes, never moving it, and returns its new usable size, or
+** 0 if it cannot reach min bytes. tlsf_malloc_at_least stores the usable
+** size of the returned block, which may exceed the request, in actual.
+*/
+size_t tlsf_expand(tlsf_t tlsf, void* ptr, size_t min, size_t preferred);
+void* tlsf_malloc_at_least(tlsf_t tlsf, size_t bytes, size_t* actual);
+
+/*
+** Placement flags for tlsf_malloc_ex. ISOLATE gives the block cache lines
+** of its own: it starts on a line and no other block's data shares its
+** last line. NO_SPLIT keeps up to the requested size again as slack for
+** growing with tlsf_expand or tlsf_realloc.
+*/
+enum tlsf_malloc_flags
+{
+	TLSF_MALLOC_ISOLATE = 1 << 0,
+	TLSF_MALLOC_NO_SPLIT = 1 << 1
+};
+void* tlsf_malloc_ex(tlsf_t tlsf, size_t bytes, int flags);
+
+/*
+** Expected lifetime of a block, for tlsf_malloc_hint. SHORT blocks are
+** taken from the high end of free space and others from the low end, so
+** transient blocks do not pin long-lived ones apart. With TLSF_POOL_LISTS,
+** PERMANENT blocks also go to the lowest-addressed pool with room.
+** tlsf_malloc behaves as LONG.
+*/
+enum tlsf_lifetime
+{
+	TLSF_LIFETIME_SHORT,
+	TLSF_LIFETIME_LONG,
+	TLSF_LIFETIME_PERMANENT
+};
+void* tlsf_malloc_hint(tlsf_t tlsf, size_t bytes, int lifetime);
+
+/*
+** Allocation priorities (requires TLSF_PRIO), most urgent first.
+** tlsf_malloc_prio fails when the request, rounded up to the alignment,
+** would leave the heap with fewer free bytes than the level's watermark,
+** so that lower levels cannot take the last free memory from higher ones.
+** Watermarks start at 0; give lower levels higher marks. Each level
+** counts the requests its watermark denied. tlsf_free_bytes is the total
+** size of free blocks, counted as blocks come and go, and leaves out
+** pools that are draining.
+*/
+enum tlsf_priority
+{
+	TLSF_PRIO_CRITICAL,
+	TLSF_PRIO_HIGH,
+	TLSF_PRIO_NORMAL,
+	TLSF_PRIO_LOW,
+	TLSF_PRIO_COUNT
+};
+void* tlsf_malloc_prio(tlsf_t tlsf, size_t bytes, int prio);
+void tlsf_set_prio_watermark(tlsf_t tlsf, int prio, size_t bytes);
+unsigned long long tlsf_prio_denied(tlsf_t tlsf, int prio);
+size_t tlsf_free_bytes(tlsf_t tlsf);
+
+/*
+** Allocate a block of an already adjusted size from a precomputed size
+** class; see tlsf_inline.h, whose macros compute the arguments. Arguments
+** that do not describe the size's class are handled as tlsf_malloc.
+*/
+void* tlsf_malloc_class(tlsf_t tlsf, size_t bytes, int fl, int sl);
+
+/*
+** With TLSF_MMAP (POSIX only), requests of at least the threshold bytes
+** are mapped from the system directly rather than taken from a pool, and
+** tlsf_realloc resizes them with mremap on Linux. They are freed and
+** sized like any other block. The default threshold is 32 MiB; 0 turns
+** mapping off, as it always is for shared heaps.
+*/
+void tlsf_set_mmap_threshold(tlsf_t tlsf, size_t bytes);
+
+/*
+** Allocate only from the given pool (requires TLSF_POOL_LISTS, which
+** gives each pool its own free lists). Blocks are freed as usual.
+*/
+void* tlsf_malloc_from_pool(tlsf_t tlsf, pool_t pool, size_t bytes);
+void* tlsf_memalign_from_pool(tlsf_t tlsf, pool_t pool, size_t align, size_t bytes);
+
+/*
+** Pool draining (requires TLSF_POOL_LISTS). Nothing new is allocated from
+** a draining pool, though its blocks may still be freed or shrunk. When a
+** draining pool has no used blocks left, the drained handler is called
+** without the heap lock held, so it may remove the pool. tlsf_pool_used
+** returns the bytes in a pool's used blocks.
+*/
+typedef void (*tlsf_pool_handler)(tlsf_t tlsf, pool_t pool, void* user);
+void tlsf_pool_set_draining(tlsf_t tlsf, pool_t pool, int draining);
+size_t tlsf_pool_used(tlsf_t tlsf, pool_t pool);
+void tlsf_set_pool_drained_handler(tlsf_t tlsf, tlsf_pool_handler handler, void* user);
+
+/*
+** Coalesce up to max_blocks blocks whose free was deferred (only with
+** TLSF_DEFER_COALESCE). Returns the number still pending.
+*/
+size_t tlsf_coalesce(tlsf_t tlsf, size_t max_blocks);
+
+/*
+** Regions: bump allocation from chunks of a heap, released all at once.
+** A region takes bytes up front and further chunks of that size as it
+** fills. tlsf_region_free only reclaims the latest allocation; reset
+** keeps the first chunk and returns the rest. A region is not locked;
+** use it from one thread at a time.
+*/
+typedef void* tlsf_region_t;
+tlsf_region_t tlsf_region_create(tlsf_t tlsf, size_t bytes);
+void tlsf_region_destroy(tlsf_region_t region);
+void* tlsf_region_malloc(tlsf_region_t region, size_t bytes);
+void* tlsf_region_memalign(tlsf_region_t region, size_t align, size_t bytes);
+void tlsf_region_free(tlsf_region_t region, void* ptr);
+void tlsf_region_reset(tlsf_region_t region);
+
+/*
+** Child heaps: heaps whose pools are chunks of at least chunk_bytes
+** borrowed from a parent heap, with a quota on the bytes in live blocks.
+** Allocations that would exceed the quota return null, as do those the
+** parent cannot supply a chunk for. Empty chunks go back to the parent,
+** except the last, and destroy returns them all. A child is not locked;
+** use each from one thread at a time. The parent may be shared if it is
+** built with TLSF_LOCK.
+*/
+typedef void* tlsf_child_t;
+tlsf_child_t tlsf_child_create(tlsf_t parent, size_t chunk_bytes, size_t quota);
+void tlsf_child_destroy(tlsf_child_t child);
+void* tlsf_child_malloc(tlsf_child_t child, size_t bytes);
+void* tlsf_child_memalign(tlsf_child_t child, size_t align, size_t bytes);
+void* tlsf_child_realloc(tlsf_child_t child, void* ptr, size_t size);
+void tlsf_child_free(tlsf_child_t child, void* ptr);
+void tlsf_child_set_quota(tlsf_child_t child, size_t quota);
+
+/* Bytes in the child's live blocks, and bytes it holds of the parent. */
+size_t tlsf_child_used(tlsf_child_t child);
+size_t tlsf_child_borrowed(tlsf_child_t child);
+
+/*
+** Owner lookup (requires TLSF_REGISTRY). Pools are recorded process-wide
+** as they are added, attached and removed, and tlsf_destroy forgets a
+** heap's pools, so it must be called before a heap's memory is reused.
+** tlsf_owner returns the heap whose pool holds ptr, or null, without
+** taking any lock; tlsf_free_any frees ptr into that heap. Blocks of a
+** child heap resolve to the child's own heap and should still be freed
+** with tlsf_child_free, which keeps its quota. Blocks mapped directly
+** with TLSF_MMAP lie in no pool and must be freed through their heap.
+*/
+tlsf_t tlsf_owner(const void* ptr);
+void tlsf_free_any(void* ptr);
+
 /* Returns internal block size, not original request size */
 size_t tlsf_block_size(void* ptr);
 
+/*
+** log2 of the number of second-level classes each power of two is split
+** into, from 3 to 5. Higher values waste less to rounding at the cost of
+** a larger control structure (tlsf_size). Define it when building tlsf.c
+** and anything that includes tlsf_inline.h, to the same value.
+*/
+#if !defined (TLSF_SL_INDEX_COUNT_LOG2)
+#define TLSF_SL_INDEX_COUNT_LOG2 5
+#endif
+
 /* Overheads/limits of internal structures. */
 size_t tlsf_size(void);
 size_t tlsf_align_size(void);
+size_t tlsf_sl_index_count(void);
 size_t tlsf_block_size_min(void);
 size_t tlsf_block_size_max(void);
 size_t tlsf_pool_overhead(void);
@@ -83,6 +252,184 @@ void tlsf_walk_pool(pool_t pool, tlsf_walker walker, void* user);
 int tlsf_check(tlsf_t tlsf);
 int tlsf_check_pool(pool_t pool);
 
+/*
+** Heap maps: tlsf_export_pool streams a compact binary map of every
+** block in a pool, in the format the README describes, to writer in
+** pieces of at most 256 bytes. The writer runs with the heap lock held
+** and must not call into the heap; a nonzero return stops the export and
+** is returned. Blocks whose free was deferred appear used.
+*/
+typedef int (*tlsf_writer)(const void* data, size_t bytes, void* user);
+int tlsf_export_pool(tlsf_t tlsf, pool_t pool, tlsf_writer writer, void* user);
+
+/*
+** Snapshots of the used blocks in a pool, a few bytes per block, for
+** finding what accumulates over time. tlsf_snapshot_take returns the
+** size the snapshot needs and only fills buffer if capacity is enough,
+** so call it once to size the buffer; the pool may grow in between.
+** tlsf_snapshot_diff compares two snapshots of the same pool and calls
+** reporter, in size order, for each power-of-two size class with blocks
+** that appeared since the older one, persisted through both, or were
+** freed. A block persists if its address, size and tag are unchanged;
+** blocks whose free was deferred count as used. Returns nonzero, without
+** reporting, if a snapshot is malformed or the two are of different pools.
+*/
+typedef struct tlsf_snapshot_class_t
+{
+	/* Block sizes in the class. */
+	size_t size_min;
+	size_t size_max;
+	size_t appeared;
+	size_t appeared_bytes;
+	size_t persisted;
+	size_t persisted_bytes;
+	size_t freed;
+	size_t freed_bytes;
+} tlsf_snapshot_class_t;
+typedef void (*tlsf_snapshot_reporter)(const tlsf_snapshot_class_t* diff, void* user);
+size_t tlsf_snapshot_take(tlsf_t tlsf, pool_t pool, void* buffer, size_t capacity);
+int tlsf_snapshot_diff(const void* older, size_t older_bytes,
+	const void* newer, size_t newer_bytes,
+	tlsf_snapshot_reporter reporter, void* user);
+
+/*
+** Histograms of timestamp deltas (TSC cycles on x86, nanoseconds
+** elsewhere). Bucket i counts values from tlsf_histogram_bucket_min(i) up
+** to the next bucket's minimum; powers of two are split four ways.
+*/
+#define TLSF_HISTOGRAM_BUCKETS 160
+typedef struct tlsf_histogram_t
+{
+	unsigned long long count;
+	unsigned long long total;
+	unsigned long long max;
+	unsigned long long bucket[TLSF_HISTOGRAM_BUCKETS];
+} tlsf_histogram_t;
+unsigned long long tlsf_histogram_bucket_min(int bucket);
+
+/*
+** Allocation tags (requires TLSF_TAGS and a 64-bit build). A tag below
+** TLSF_TAG_COUNT is kept in spare bits of the block header, and the heap
+** counts live bytes and blocks per tag. Untagged allocations get tag 0;
+** realloc keeps the tag. The tagged walk visits used blocks only.
+*/
+#define TLSF_TAG_COUNT 256
+typedef struct tlsf_tag_stats_t
+{
+	size_t bytes;
+	size_t count;
+} tlsf_tag_stats_t;
+void* tlsf_malloc_tagged(tlsf_t tlsf, size_t bytes, unsigned int tag);
+void* tlsf_memalign_tagged(tlsf_t tlsf, size_t align, size_t bytes, unsigned int tag);
+unsigned int tlsf_block_tag(void* ptr);
+void tlsf_tag_stats(tlsf_t tlsf, unsigned int tag, tlsf_tag_stats_t* stats);
+void tlsf_walk_pool_tagged(pool_t pool, unsigned int tag, tlsf_walker walker, void* user);
+
+/* Per-operation statistics (requires TLSF_STATS). */
+enum tlsf_stat_op
+{
+	TLSF_STAT_MALLOC,
+	TLSF_STAT_MEMALIGN,
+	TLSF_STAT_REALLOC,
+	TLSF_STAT_FREE,
+	TLSF_STAT_OP_COUNT
+};
+typedef struct tlsf_stats_t
+{
+	tlsf_histogram_t latency[TLSF_STAT_OP_COUNT];
+	unsigned long long realloc_moves;
+	unsigned long long failed_searches;
+	unsigned long long splits;
+	unsigned long long merges;
+} tlsf_stats_t;
+void tlsf_stats(tlsf_t tlsf, tlsf_stats_t* stats);
+void tlsf_stats_reset(tlsf_t tlsf);
+
+/*
+** Internal operation profiles (requires TLSF_PROFILE): histograms of the
+** free-list search, block splits and merges, and free-list insertions and
+** removals. Times are inclusive of nested operations.
+*/
+enum tlsf_profile_op
+{
+	TLSF_PROFILE_SEARCH,
+	TLSF_PROFILE_SPLIT,
+	TLSF_PROFILE_MERGE,
+	TLSF_PROFILE_INSERT,
+	TLSF_PROFILE_REMOVE,
+	TLSF_PROFILE_OP_COUNT
+};
+typedef struct tlsf_profile_t
+{
+	tlsf_histogram_t ops[TLSF_PROFILE_OP_COUNT];
+} tlsf_profile_t;
+void tlsf_profile(tlsf_t tlsf, tlsf_profile_t* profile);
+void tlsf_profile_reset(tlsf_t tlsf);
+
+/*
+** Replace the timestamp read by statistics and profiles, for example with
+** a reader of a perf_event_open counter, so histograms count events such
+** as instructions or cache misses. Process-wide; set it before any heap
+** is used. A null counter restores the default.
+*/
+typedef unsigned long long (*tlsf_counter)(void* user);
+void tlsf_set_counter(tlsf_counter counter, void* user);
+
+/*
+** Event hooks (requires TLSF_HOOKS). Each member may be null. Allocation
+** events come from the public entry points, outside the heap lock, with
+** the requested size; a realloc that moves its block reports a move
+** rather than an allocation and a free. Splits and merges report the
+** header address and size of the blocks involved, with the lock held, and
+** must not call back into the heap. Process-wide; set it before any heap
+** is used. The same events are USDT probes of provider tlsf with
+** TLSF_USDT, see the README.
+*/
+typedef struct tlsf_hooks_t
+{
+	void (*on_alloc)(void* user, tlsf_t tlsf, void* ptr, size_t size);
+	void (*on_alloc_failed)(void* user, tlsf_t tlsf, size_t size);
+	void (*on_free)(void* user, tlsf_t tlsf, void* ptr, size_t size);
+	void (*on_realloc_move)(void* user, tlsf_t tlsf, void* from, void* to, size_t size);
+	void (*on_split)(void* user, void* block, size_t size, size_t remainder);
+	void (*on_merge)(void* user, void* block, size_t size);
+	void (*on_pool_add)(void* user, tlsf_t tlsf, pool_t pool, size_t bytes);
+	void (*on_pool_remove)(void* user, tlsf_t tlsf, pool_t pool);
+} tlsf_hooks_t;
+void tlsf_set_hooks(const tlsf_hooks_t* hooks, void* user);
+
+/* Built-in locking statistics (requires TLSF_LOCK). */
+typedef struct tlsf_lock_stats_t
+{
+	unsigned long long acquisitions;
+	/* Acquisitions that found the lock held. */
+	unsigned long long contended;
+	/* Times a waiter gave up spinning and slept. */
+	unsigned long long sleeps;
+	tlsf_histogram_t hold;
+	tlsf_histogram_t wait;
+} tlsf_lock_stats_t;
+void tlsf_lock_stats(tlsf_t tlsf, tlsf_lock_stats_t* stats);
+void tlsf_lock_stats_reset(tlsf_t tlsf);
+
+/*
+** Process-shared heaps (requires TLSF_SHARED and POSIX robust mutexes).
+** The heap, its lock and a single pool live in one segment, which must be
+** mapped at the same address in every process. Lock returns 0 if the heap
+** could not be recovered after a lock holder died; recovery keeps used
+** blocks and frees the rest, including frees still deferred.
+*/
+typedef void* tlsf_shared_t;
+size_t tlsf_shared_size(void);
+tlsf_shared_t tlsf_shared_create(void* mem, size_t bytes);
+tlsf_shared_t tlsf_shared_attach(void* mem);
+tlsf_t tlsf_shared_lock(tlsf_shared_t shared);
+void tlsf_shared_unlock(tlsf_shared_t shared);
+void* tlsf_shared_malloc(tlsf_shared_t shared, size_t bytes);
+void* tlsf_shared_memalign(tlsf_shared_t shared, size_t align, size_t bytes);
+void* tlsf_shared_realloc(tlsf_shared_t shared, void* ptr, size_t size);
+void tlsf_shared_free(tlsf_shared_t shared, void* ptr);
+
 #if defined(__cplusplus)
 };
 #endif
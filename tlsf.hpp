@@ -0,0 +1,136 @@
+#ifndef INCLUDED_tlsf_hpp
+#define INCLUDED_tlsf_hpp
+
+/*
+** C++ adapters for TLSF heaps.
+**
+** tlsf::allocator<T> is a standard allocator and, when the library
+** provides <memory_resource>, tlsf::memory_resource is a
+** std::pmr::memory_resource; both draw from an existing tlsf_t. Requests
+** only go through tlsf_memalign when their alignment exceeds
+** tlsf_align_size(). Sizes passed to deallocation are not needed, since
+** TLSF blocks carry their own size.
+**
+** Neither adapter owns the heap or adds locking; the heap must outlive
+** them and be used as tlsf.h describes.
+*/
+
+#include <cstddef>
+#include <limits>
+#include <new>
+
+#include "tlsf.h"
+
+#if __cplusplus >= 201703L && defined (__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define TLSF_HAS_MEMORY_RESOURCE
+#endif
+#endif
+
+namespace tlsf
+{
+
+/* Allocate bytes aligned to alignment, or return null. */
+inline void* allocate(tlsf_t heap, std::size_t bytes, std::size_t alignment)
+{
+	/* tlsf_malloc(0) returns null, which C++ allocators may not. */
+	const std::size_t size = bytes ? bytes : 1;
+	return alignment > tlsf_align_size()
+		? tlsf_memalign(heap, alignment, size)
+		: tlsf_malloc(heap, size);
+}
+
+template <typename T>
+class allocator
+{
+public:
+	typedef T value_type;
+
+	explicit allocator(tlsf_t heap) noexcept : heap_(heap) {}
+
+	template <typename U>
+	allocator(const allocator<U>& other) noexcept : heap_(other.heap()) {}
+
+	T* allocate(std::size_t n)
+	{
+		void* p;
+		if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+		{
+			throw std::bad_alloc();
+		}
+		p = tlsf::allocate(heap_, n * sizeof(T), alignof(T));
+		if (!p)
+		{
+			throw std::bad_alloc();
+		}
+		return static_cast<T*>(p);
+	}
+
+	void deallocate(T* p, std::size_t) noexcept
+	{
+		tlsf_free(heap_, p);
+	}
+
+	tlsf_t heap() const noexcept
+	{
+		return heap_;
+	}
+
+private:
+	tlsf_t heap_;
+};
+
+template <typename T, typename U>
+inline bool operator==(const allocator<T>& a, const allocator<U>& b) noexcept
+{
+	return a.heap() == b.heap();
+}
+
+template <typename T, typename U>
+inline bool operator!=(const allocator<T>& a, const allocator<U>& b) noexcept
+{
+	return a.heap() != b.heap();
+}
+
+#if defined (TLSF_HAS_MEMORY_RESOURCE)
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+	explicit memory_resource(tlsf_t heap) noexcept : heap_(heap) {}
+
+	tlsf_t heap() const noexcept
+	{
+		return heap_;
+	}
+
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		void* p = tlsf::allocate(heap_, bytes, alignment);
+		if (!p)
+		{
+			throw std::bad_alloc();
+		}
+		return p;
+	}
+
+	void do_deallocate(void* p, std::size_t, std::size_t) override
+	{
+		tlsf_free(heap_, p);
+	}
+
+	/* Resources are interchangeable when they draw from the same heap. */
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		const memory_resource* resource = dynamic_cast<const memory_resource*>(&other);
+		return resource && resource->heap_ == heap_;
+	}
+
+	tlsf_t heap_;
+};
+#endif
+
+}
+
+#endif
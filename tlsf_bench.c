@@ -0,0 +1,402 @@
+/*
+** Microbenchmark of the allocator's entry points and internal operations.
+**
+** Build alongside tlsf.c with statistics and profiles enabled:
+**
+**	cc -O2 -DTLSF_STATS -DTLSF_PROFILE -o tlsf_bench tlsf_bench.c tlsf.c -lpthread
+**
+** For each heap fill level and each hardware event, a heap is filled with
+** random blocks until a request fails, then thinned out at random to the
+** fill level, and a fixed random mix of malloc, memalign, realloc and free
+** runs on top. The mean event count per call of every public operation and
+** of every internal one (free-list search, split, merge, insert, remove)
+** is printed as a flat JSON object keyed "fill<level>.<event>.<operation>".
+** Each run is repeated and the lowest mean kept, to damp noise.
+**
+** Events are cycles, instructions, L1D read misses, LLC misses and branch
+** misses, counted in user space with perf_event_open on Linux. Events the
+** system cannot count are left out; where none can be counted, "ticks" of
+** the default timestamp (see tlsf_set_counter) are measured instead.
+** Counters are read with a system call, which adds a constant to every
+** sample; it cancels out against a baseline taken the same way.
+**
+**	tlsf_bench > baseline.json
+**	tlsf_bench -b baseline.json [-t percent]
+**
+** With -b, each metric more than the tolerance (default 10) percent and at
+** least one event per call above the baseline is reported as a regression,
+** and the exit status is 1 if there is any.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "tlsf.h"
+
+#if !defined (TLSF_STATS) || !defined (TLSF_PROFILE)
+#error tlsf_bench needs tlsf.c built with TLSF_STATS and TLSF_PROFILE.
+#endif
+
+enum bench_constants
+{
+	BENCH_POOL_SIZE = 16 * 1024 * 1024,
+	BENCH_SLOTS = 1024,
+	BENCH_OPS = 200000,
+	BENCH_REPEATS = 3,
+	BENCH_METRICS_MAX = 512,
+};
+
+static const int bench_fills[] = { 0, 25, 50, 75, 90 };
+
+static const char* const bench_stat_names[TLSF_STAT_OP_COUNT] =
+{
+	"malloc", "memalign", "realloc", "free",
+};
+
+static const char* const bench_profile_names[TLSF_PROFILE_OP_COUNT] =
+{
+	"search", "split", "merge", "insert", "remove",
+};
+
+typedef struct bench_event_t
+{
+	const char* name;
+	unsigned int type;
+	unsigned long long config;
+	int fd;
+} bench_event_t;
+
+#if defined (__linux__)
+#define BENCH_CACHE_EVENT(cache, op, result) \
+	((cache) | ((op) << 8) | ((result) << 16))
+
+static bench_event_t bench_events[] =
+{
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+	{ "l1d_misses", PERF_TYPE_HW_CACHE, BENCH_CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D,
+		PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS), -1 },
+	{ "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+	{ "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1 },
+};
+
+static int bench_event_open(bench_event_t* event)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	event->fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	return event->fd >= 0;
+}
+
+static unsigned long long bench_event_read(void* user)
+{
+	const bench_event_t* event = (const bench_event_t*)user;
+	unsigned long long value = 0;
+
+	if (read(event->fd, &value, sizeof(value)) != (ssize_t)sizeof(value))
+	{
+		return 0;
+	}
+	return value;
+}
+#else
+static bench_event_t bench_events[] = { { "none", 0, 0, -1 } };
+#define bench_event_open(event) 0
+#define bench_event_read 0
+#endif
+
+/* The fallback when no event can be counted: the default timestamp. */
+static bench_event_t bench_ticks = { "ticks", 0, 0, -1 };
+
+typedef struct bench_metric_t
+{
+	char name[64];
+	double value;
+} bench_metric_t;
+
+static bench_metric_t bench_metrics[BENCH_METRICS_MAX];
+static int bench_metric_count;
+
+/* Record a mean, keeping the lowest of repeated runs. */
+static void bench_metric_add(int fill, const char* event, const char* op, double value)
+{
+	char name[64];
+	int i;
+
+	sprintf(name, "fill%d.%.20s.%.12s", fill, event, op);
+	for (i = 0; i < bench_metric_count; ++i)
+	{
+		if (strcmp(bench_metrics[i].name, name) == 0)
+		{
+			if (value < bench_metrics[i].value)
+			{
+				bench_metrics[i].value = value;
+			}
+			return;
+		}
+	}
+
+	if (bench_metric_count < BENCH_METRICS_MAX)
+	{
+		strcpy(bench_metrics[bench_metric_count].name, name);
+		bench_metrics[bench_metric_count].value = value;
+		++bench_metric_count;
+	}
+}
+
+static unsigned int bench_random(unsigned int* state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state >> 8;
+}
+
+/* Mostly small requests, with one in eight up to 4 KiB. */
+static size_t bench_size(unsigned int* state)
+{
+	const unsigned int r = bench_random(state);
+	return (r & 7) ? 16 + r % 240 : 256 + r % 3840;
+}
+
+static double bench_mean(const tlsf_histogram_t* histogram)
+{
+	return histogram->count ? (double)histogram->total / (double)histogram->count : 0.0;
+}
+
+/*
+** Fill a fresh heap to fill percent, run the operation mix with event
+** counting the samples, and record the means.
+*/
+static int bench_run(int fill, bench_event_t* event, int counted)
+{
+	const size_t capacity = BENCH_POOL_SIZE / (16 + tlsf_alloc_overhead());
+	char* mem = (char*)malloc(tlsf_size() + BENCH_POOL_SIZE);
+	void** blocks = (void**)malloc(capacity * sizeof(void*));
+	void* slots[BENCH_SLOTS];
+	size_t count = 0, used = 0;
+	unsigned int state = 1;
+	tlsf_stats_t stats;
+	tlsf_profile_t profile;
+	tlsf_t tlsf;
+	long i;
+	int op;
+
+	if (!mem || !blocks)
+	{
+		free(mem);
+		free(blocks);
+		return 0;
+	}
+	tlsf = tlsf_create_with_pool(mem, tlsf_size() + BENCH_POOL_SIZE);
+
+	/* Fill until a request fails, then free at random down to the level. */
+	while (count < capacity)
+	{
+		void* p = tlsf_malloc(tlsf, bench_size(&state));
+		if (!p)
+		{
+			break;
+		}
+		used += tlsf_block_size(p);
+		blocks[count++] = p;
+	}
+	while (count && used > (size_t)BENCH_POOL_SIZE / 100 * fill)
+	{
+		const size_t j = bench_random(&state) % count;
+		used -= tlsf_block_size(blocks[j]);
+		tlsf_free(tlsf, blocks[j]);
+		blocks[j] = blocks[--count];
+	}
+
+	memset(slots, 0, sizeof(slots));
+	tlsf_stats_reset(tlsf);
+	tlsf_profile_reset(tlsf);
+	tlsf_set_counter(counted ? bench_event_read : 0, event);
+
+	for (i = 0; i < BENCH_OPS; ++i)
+	{
+		const unsigned int r = bench_random(&state);
+		void** slot = &slots[r % BENCH_SLOTS];
+
+		if (!*slot)
+		{
+			*slot = (r & 0x1000)
+				? tlsf_memalign(tlsf, 64, bench_size(&state))
+				: tlsf_malloc(tlsf, bench_size(&state));
+		}
+		else if (r & 0x2000)
+		{
+			void* p = tlsf_realloc(tlsf, *slot, bench_size(&state));
+			if (p)
+			{
+				*slot = p;
+			}
+		}
+		else
+		{
+			tlsf_free(tlsf, *slot);
+			*slot = 0;
+		}
+	}
+
+	tlsf_set_counter(0, 0);
+	tlsf_stats(tlsf, &stats);
+	tlsf_profile(tlsf, &profile);
+	for (op = 0; op < TLSF_STAT_OP_COUNT; ++op)
+	{
+		bench_metric_add(fill, event->name, bench_stat_names[op], bench_mean(&stats.latency[op]));
+	}
+	for (op = 0; op < TLSF_PROFILE_OP_COUNT; ++op)
+	{
+		bench_metric_add(fill, event->name, bench_profile_names[op], bench_mean(&profile.ops[op]));
+	}
+
+	tlsf_destroy(tlsf);
+	free(blocks);
+	free(mem);
+	return 1;
+}
+
+/* Read a baseline written by this program; returns the metric count. */
+static int bench_load(const char* path, bench_metric_t* metrics, int capacity)
+{
+	FILE* file = fopen(path, "r");
+	char line[256];
+	int count = 0;
+
+	if (!file)
+	{
+		return -1;
+	}
+	while (count < capacity && fgets(line, sizeof(line), file))
+	{
+		bench_metric_t* metric = &metrics[count];
+		if (sscanf(line, " \"%63[^\"]\" : %lf", metric->name, &metric->value) == 2)
+		{
+			++count;
+		}
+	}
+	fclose(file);
+	return count;
+}
+
+static int bench_compare(const char* path, double tolerance)
+{
+	static bench_metric_t baseline[BENCH_METRICS_MAX];
+	const int count = bench_load(path, baseline, BENCH_METRICS_MAX);
+	int regressions = 0, compared = 0;
+	int i, j;
+
+	if (count < 0)
+	{
+		printf("tlsf_bench: cannot read baseline %s\n", path);
+		return 2;
+	}
+
+	for (i = 0; i < bench_metric_count; ++i)
+	{
+		const bench_metric_t* metric = &bench_metrics[i];
+		for (j = 0; j < count; ++j)
+		{
+			if (strcmp(baseline[j].name, metric->name) == 0)
+			{
+				const double base = baseline[j].value;
+				++compared;
+				if (metric->value - base >= 1.0
+					&& metric->value > base * (1.0 + tolerance / 100.0))
+				{
+					printf("regression: %s %.1f -> %.1f (%+.1f%%)\n", metric->name,
+						base, metric->value, base > 0 ? (metric->value / base - 1.0) * 100.0 : 100.0);
+					++regressions;
+				}
+				break;
+			}
+		}
+	}
+
+	printf("%d of %d metrics compared, %d regressions\n", compared, bench_metric_count, regressions);
+	return regressions ? 1 : 0;
+}
+
+static void bench_print(void)
+{
+	int i;
+
+	printf("{\n");
+	for (i = 0; i < bench_metric_count; ++i)
+	{
+		printf("\t\"%s\": %.2f%s\n", bench_metrics[i].name, bench_metrics[i].value,
+			i + 1 < bench_metric_count ? "," : "");
+	}
+	printf("}\n");
+}
+
+int main(int argc, char** argv)
+{
+	const int event_count = (int)(sizeof(bench_events) / sizeof(bench_events[0]));
+	const char* baseline = 0;
+	double tolerance = 10.0;
+	int counted = 0;
+	int repeat, i, f;
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+		{
+			baseline = argv[++i];
+		}
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+		{
+			tolerance = atof(argv[++i]);
+		}
+		else
+		{
+			printf("usage: %s [-b baseline.json] [-t percent]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for (i = 0; i < event_count; ++i)
+	{
+		counted += bench_event_open(&bench_events[i]);
+	}
+
+	for (repeat = 0; repeat < BENCH_REPEATS; ++repeat)
+	{
+		for (f = 0; f < (int)(sizeof(bench_fills) / sizeof(bench_fills[0])); ++f)
+		{
+			if (!counted)
+			{
+				bench_run(bench_fills[f], &bench_ticks, 0);
+			}
+			for (i = 0; i < event_count; ++i)
+			{
+				if (bench_events[i].fd >= 0)
+				{
+					bench_run(bench_fills[f], &bench_events[i], 1);
+				}
+			}
+		}
+	}
+
+	if (baseline)
+	{
+		return bench_compare(baseline, tolerance);
+	}
+	bench_print();
+	return 0;
+}
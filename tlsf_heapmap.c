@@ -0,0 +1,480 @@
+/*
+** Reader for the heap maps tlsf_export_pool writes, reporting free space
+** per map and drawing pool occupancy.
+**
+** Build alongside tlsf.c, with the configuration whose maps are read:
+**
+**	cc -O2 -o tlsf_heapmap tlsf_heapmap.c tlsf.c -lpthread
+**	tlsf_heapmap [-w width] [-o image.pgm] map...
+**	tlsf_heapmap -t
+**
+** Each file may hold several maps, as concatenated by the writer. For
+** each map a line is printed, followed by a histogram of its free blocks
+** by power-of-two size:
+**
+**	map=0 pool=0x7f3a2c000010 bytes=1048576 blocks=301 used=... free=...
+**	largest_free=... frag=...
+**		free=64..127 blocks=12 bytes=1152
+**
+** bytes counts the pool's blocks with their headers, and used and free
+** the data bytes of used and free blocks. frag is one less the ratio of
+** the largest free block to all free bytes, as in tlsf_replay.c.
+**
+** With -o, occupancy is written as a binary PGM image, one row per map
+** and width pixels across (default 1024), each row scaled to its own
+** pool. A pixel is black where every byte it covers is used, headers
+** included, and white where all are free.
+**
+** With -t, a heap of this build is filled, partly freed and exported at
+** several points, and the maps are read back and checked against
+** tlsf_walk_pool, so the reader and the writer agree on the format.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tlsf.h"
+
+enum heapmap_constants
+{
+	HEAPMAP_VERSION = 1,
+	HEAPMAP_WIDTH = 1024,
+	HEAPMAP_BINS = 8 * sizeof(size_t),
+	HEAPMAP_TEST_POOL = 1024 * 1024,
+	HEAPMAP_TEST_BLOCKS = 512,
+	HEAPMAP_TEST_MAPS = 4,
+};
+
+typedef struct heapmap_block_t
+{
+	/* Offset of the block's data from the pool's address. */
+	size_t offset;
+	size_t size;
+	int used;
+	unsigned int tag;
+} heapmap_block_t;
+
+typedef struct heapmap_t
+{
+	int tags;
+	size_t align;
+	size_t overhead;
+	size_t pool;
+	heapmap_block_t* blocks;
+	size_t count;
+	size_t capacity;
+} heapmap_t;
+
+static int heapmap_push(heapmap_t* map, size_t offset, size_t size, int used, unsigned int tag)
+{
+	heapmap_block_t* block;
+	if (map->count == map->capacity)
+	{
+		const size_t capacity = map->capacity ? map->capacity * 2 : 256;
+		heapmap_block_t* blocks = (heapmap_block_t*)realloc(map->blocks, capacity * sizeof(*blocks));
+		if (!blocks)
+		{
+			return 0;
+		}
+		map->blocks = blocks;
+		map->capacity = capacity;
+	}
+	block = &map->blocks[map->count++];
+	block->offset = offset;
+	block->size = size;
+	block->used = used;
+	block->tag = tag;
+	return 1;
+}
+
+static int heapmap_varint(FILE* file, size_t* value)
+{
+	unsigned int shift = 0;
+	int c;
+
+	*value = 0;
+	while ((c = getc(file)) != EOF)
+	{
+		if (shift >= 8 * sizeof(size_t) || ((size_t)(c & 0x7f) << shift) >> shift != (size_t)(c & 0x7f))
+		{
+			return 0;
+		}
+		*value |= (size_t)(c & 0x7f) << shift;
+		if (!(c & 0x80))
+		{
+			return 1;
+		}
+		shift += 7;
+	}
+	return 0;
+}
+
+/*
+** Read the next map of a file into map, replacing its blocks. Returns 1
+** for a map, 0 at the end of the file and -1 if the map is malformed.
+*/
+static int heapmap_read(FILE* file, heapmap_t* map)
+{
+	char magic[4];
+	size_t value, offset;
+	int version, flags;
+
+	map->count = 0;
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic))
+	{
+		return 0;
+	}
+	version = getc(file);
+	flags = getc(file);
+	if (memcmp(magic, "TLSF", sizeof(magic)) != 0 || version != HEAPMAP_VERSION || flags == EOF
+		|| !heapmap_varint(file, &map->align) || !heapmap_varint(file, &map->overhead)
+		|| !heapmap_varint(file, &map->pool) || !map->align)
+	{
+		return -1;
+	}
+	map->tags = flags & 1;
+
+	offset = map->overhead;
+	while (heapmap_varint(file, &value))
+	{
+		const size_t size = (value >> 1) * map->align;
+		int tag = 0;
+		if (!value)
+		{
+			return 1;
+		}
+		if (map->tags && (tag = getc(file)) == EOF)
+		{
+			return -1;
+		}
+		if (size / map->align != value >> 1 || !heapmap_push(map, offset, size, (int)(value & 1), (unsigned int)tag))
+		{
+			return -1;
+		}
+		offset += size + map->overhead;
+	}
+	return -1;
+}
+
+/* Bytes the map's blocks span, headers included. */
+static size_t heapmap_span(const heapmap_t* map)
+{
+	return map->count ? map->blocks[map->count - 1].offset + map->blocks[map->count - 1].size : 0;
+}
+
+static int heapmap_bin(size_t size)
+{
+	int bin = 0;
+	while (size >>= 1)
+	{
+		++bin;
+	}
+	return bin;
+}
+
+static void heapmap_print(unsigned long index, const heapmap_t* map)
+{
+	size_t bin_blocks[HEAPMAP_BINS], bin_bytes[HEAPMAP_BINS];
+	size_t used = 0, free_bytes = 0, largest = 0, i;
+	int bin;
+
+	memset(bin_blocks, 0, sizeof(bin_blocks));
+	memset(bin_bytes, 0, sizeof(bin_bytes));
+	for (i = 0; i < map->count; ++i)
+	{
+		const heapmap_block_t* block = &map->blocks[i];
+		if (block->used)
+		{
+			used += block->size;
+		}
+		else
+		{
+			free_bytes += block->size;
+			largest = block->size > largest ? block->size : largest;
+			bin = heapmap_bin(block->size);
+			bin_blocks[bin]++;
+			bin_bytes[bin] += block->size;
+		}
+	}
+
+	printf("map=%lu pool=0x%lx bytes=%lu blocks=%lu used=%lu free=%lu largest_free=%lu frag=%.4f\n",
+		index, (unsigned long)map->pool, (unsigned long)heapmap_span(map),
+		(unsigned long)map->count, (unsigned long)used, (unsigned long)free_bytes,
+		(unsigned long)largest, free_bytes ? 1.0 - (double)largest / (double)free_bytes : 0.0);
+	for (bin = 0; bin < HEAPMAP_BINS; ++bin)
+	{
+		if (bin_blocks[bin])
+		{
+			const size_t low = (size_t)1 << bin;
+			printf("\tfree=%lu..%lu blocks=%lu bytes=%lu\n", (unsigned long)low,
+				(unsigned long)(low + (low - 1)), (unsigned long)bin_blocks[bin],
+				(unsigned long)bin_bytes[bin]);
+		}
+	}
+}
+
+/*
+** Shade one image row: each pixel covers an equal share of the span, and
+** is darker the more of it used blocks and their headers take.
+*/
+static void heapmap_row(const heapmap_t* map, unsigned char* row, int width)
+{
+	const double span = (double)heapmap_span(map);
+	size_t i = 0;
+	int x;
+
+	for (x = 0; x < width; ++x)
+	{
+		const double low = span * x / width, high = span * (x + 1) / width;
+		double used = 0;
+
+		while (i < map->count && (double)(map->blocks[i].offset + map->blocks[i].size) <= low)
+		{
+			++i;
+		}
+		for (; i < map->count; ++i)
+		{
+			const heapmap_block_t* block = &map->blocks[i];
+			const double start = (double)(block->offset - map->overhead);
+			const double end = (double)(block->offset + block->size);
+			if (start >= high)
+			{
+				break;
+			}
+			if (block->used)
+			{
+				used += (end < high ? end : high) - (start > low ? start : low);
+			}
+			if (end > high)
+			{
+				break;
+			}
+		}
+		row[x] = (unsigned char)(high > low ? 255.5 - 255.0 * used / (high - low) : 255);
+	}
+}
+
+static int heapmap_export_file(const void* data, size_t bytes, void* user)
+{
+	return fwrite(data, 1, bytes, (FILE*)user) != bytes;
+}
+
+typedef struct heapmap_expected_t
+{
+	const char* pool;
+	heapmap_t* map;
+} heapmap_expected_t;
+
+static void heapmap_test_walker(void* ptr, size_t size, int used, void* user)
+{
+	heapmap_expected_t* expected = (heapmap_expected_t*)user;
+	unsigned int tag = 0;
+#if defined (TLSF_TAGS)
+	tag = used ? tlsf_block_tag(ptr) : 0;
+#endif
+	heapmap_push(expected->map, (size_t)((const char*)ptr - expected->pool), size, used, tag);
+}
+
+/* Export a heap at several fill levels and read the maps back. */
+static int heapmap_self_test(void)
+{
+	void* memory = malloc(HEAPMAP_TEST_POOL);
+	tlsf_t tlsf = tlsf_create(malloc(tlsf_size()));
+	pool_t pool = tlsf_add_pool(tlsf, memory, HEAPMAP_TEST_POOL);
+	FILE* file = tmpfile();
+	heapmap_t expected[HEAPMAP_TEST_MAPS], map;
+	void* blocks[HEAPMAP_TEST_BLOCKS];
+	unsigned long seed = 1;
+	int failures = 0, m, i, status;
+	size_t b;
+
+	memset(expected, 0, sizeof(expected));
+	memset(&map, 0, sizeof(map));
+	memset(blocks, 0, sizeof(blocks));
+	if (!pool || !file)
+	{
+		printf("tlsf_heapmap: cannot set up the test heap\n");
+		return 1;
+	}
+
+	for (m = 0; m < HEAPMAP_TEST_MAPS; ++m)
+	{
+		heapmap_expected_t walk;
+
+		for (i = 0; i < HEAPMAP_TEST_BLOCKS; ++i)
+		{
+			seed = seed * 1103515245 + 12345;
+			if (blocks[i] && (seed >> 16) % 3 == 0)
+			{
+				tlsf_free(tlsf, blocks[i]);
+				blocks[i] = 0;
+			}
+			else if (!blocks[i])
+			{
+				const size_t size = 1 + (seed >> 8) % 2000;
+#if defined (TLSF_TAGS)
+				blocks[i] = tlsf_malloc_tagged(tlsf, size, (unsigned int)(seed >> 20) % TLSF_TAG_COUNT);
+#else
+				blocks[i] = tlsf_malloc(tlsf, size);
+#endif
+			}
+		}
+
+		walk.pool = (const char*)pool;
+		walk.map = &expected[m];
+		tlsf_walk_pool(pool, heapmap_test_walker, &walk);
+		if (tlsf_export_pool(tlsf, pool, heapmap_export_file, file) != 0)
+		{
+			printf("tlsf_heapmap: export %d failed\n", m);
+			++failures;
+		}
+	}
+
+	rewind(file);
+	for (m = 0; m < HEAPMAP_TEST_MAPS; ++m)
+	{
+		status = heapmap_read(file, &map);
+		if (status != 1)
+		{
+			printf("tlsf_heapmap: map %d unreadable\n", m);
+			++failures;
+			break;
+		}
+		if (map.align != tlsf_align_size() || map.overhead != tlsf_alloc_overhead()
+			|| map.pool != (size_t)pool || map.count != expected[m].count
+#if defined (TLSF_TAGS)
+			|| !map.tags
+#else
+			|| map.tags
+#endif
+			)
+		{
+			printf("tlsf_heapmap: map %d header or block count differs\n", m);
+			++failures;
+			continue;
+		}
+		for (b = 0; b < map.count; ++b)
+		{
+			const heapmap_block_t* read = &map.blocks[b];
+			const heapmap_block_t* walked = &expected[m].blocks[b];
+			if (read->offset != walked->offset || read->size != walked->size
+				|| read->used != walked->used || read->tag != walked->tag)
+			{
+				printf("tlsf_heapmap: map %d block %lu differs\n", m, (unsigned long)b);
+				++failures;
+				break;
+			}
+		}
+	}
+	if (heapmap_read(file, &map) != 0)
+	{
+		printf("tlsf_heapmap: data after the last map\n");
+		++failures;
+	}
+
+	fclose(file);
+	for (m = 0; m < HEAPMAP_TEST_MAPS; ++m)
+	{
+		free(expected[m].blocks);
+	}
+	free(map.blocks);
+	tlsf_destroy(tlsf);
+	free(tlsf);
+	free(memory);
+
+	printf(failures ? "tlsf_heapmap: round trip failed\n" : "tlsf_heapmap: round trip passed\n");
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* image_path = 0;
+	unsigned char* image = 0;
+	unsigned long rows = 0, index = 0;
+	int width = HEAPMAP_WIDTH, first = 0, i, status = 0;
+	heapmap_t map;
+
+	for (i = 1; i < argc && !first; ++i)
+	{
+		if (strcmp(argv[i], "-t") == 0 && argc == 2)
+		{
+			return heapmap_self_test();
+		}
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+		{
+			width = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+		{
+			image_path = argv[++i];
+		}
+		else if (argv[i][0] != '-')
+		{
+			first = i;
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (!first || width < 1)
+	{
+		printf("usage: %s [-w width] [-o image.pgm] map...\n"
+			"       %s -t\n", argv[0], argv[0]);
+		return 2;
+	}
+
+	memset(&map, 0, sizeof(map));
+	for (i = first; i < argc && !status; ++i)
+	{
+		FILE* file = fopen(argv[i], "rb");
+		if (!file)
+		{
+			printf("tlsf_heapmap: cannot read %s\n", argv[i]);
+			status = 2;
+			break;
+		}
+		while ((status = heapmap_read(file, &map)) == 1)
+		{
+			heapmap_print(index++, &map);
+			if (image_path)
+			{
+				unsigned char* grown = (unsigned char*)realloc(image, (rows + 1) * (size_t)width);
+				if (!grown)
+				{
+					printf("tlsf_heapmap: out of memory\n");
+					status = 2;
+					break;
+				}
+				image = grown;
+				heapmap_row(&map, image + rows++ * (size_t)width, width);
+			}
+		}
+		if (status < 0)
+		{
+			printf("tlsf_heapmap: %s holds a malformed map\n", argv[i]);
+			status = 2;
+		}
+		fclose(file);
+	}
+
+	if (!status && image_path)
+	{
+		FILE* file = fopen(image_path, "wb");
+		if (!file || fprintf(file, "P5\n%d %lu\n255\n", width, rows) < 0
+			|| fwrite(image, (size_t)width, rows, file) != rows)
+		{
+			printf("tlsf_heapmap: cannot write %s\n", image_path);
+			status = 2;
+		}
+		if (file)
+		{
+			fclose(file);
+		}
+	}
+
+	free(image);
+	free(map.blocks);
+	return status;
+}
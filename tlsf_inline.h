@@ -0,0 +1,101 @@
+#ifndef INCLUDED_tlsf_inline
+#define INCLUDED_tlsf_inline
+
+/*
+** Size classes computed at compile time.
+**
+** tlsf_malloc rounds every request up and maps it to a free-list class
+** at run time. For a request of constant size, TLSF_MALLOC_FIXED does
+** that work while compiling and calls tlsf_malloc_class, which goes
+** straight to the bitmap search and free-list pop. In C++,
+** tlsf_malloc_fixed<N>(tlsf) does the same. Usable from C and C++:
+**
+**	struct node* n = (struct node*)TLSF_MALLOC_FIXED(tlsf, sizeof(struct node));
+**
+** The size must be a nonzero constant expression; blocks are freed with
+** tlsf_free as usual. The constants below mirror tlsf.c, which checks
+** that they agree.
+*/
+
+#include "tlsf.h"
+
+#if defined (__alpha__) || defined (__ia64__) || defined (__x86_64__) \
+	|| defined (_WIN64) || defined (__LP64__) || defined (__LLP64__)
+#define TLSF_CLASS_ALIGN_LOG2 3
+#else
+#define TLSF_CLASS_ALIGN_LOG2 2
+#endif
+
+/* Must match SL_INDEX_COUNT_LOG2 in tlsf.c, which tlsf.h sets. */
+#define TLSF_CLASS_SL_LOG2 TLSF_SL_INDEX_COUNT_LOG2
+
+#define TLSF_CLASS_ALIGN ((size_t)1 << TLSF_CLASS_ALIGN_LOG2)
+#define TLSF_CLASS_SL_COUNT (1 << TLSF_CLASS_SL_LOG2)
+#define TLSF_CLASS_FL_SHIFT (TLSF_CLASS_SL_LOG2 + TLSF_CLASS_ALIGN_LOG2)
+#define TLSF_CLASS_SMALL ((size_t)1 << TLSF_CLASS_FL_SHIFT)
+#define TLSF_CLASS_SIZE_MIN (3 * sizeof(void*))
+
+/* Block size for a request, as adjust_request_size in tlsf.c. */
+#define tlsf_class_aligned(size) \
+	(((size_t)(size) + (TLSF_CLASS_ALIGN - 1)) & ~(TLSF_CLASS_ALIGN - 1))
+#define TLSF_CLASS_ADJUST(size) \
+	(tlsf_class_aligned(size) < TLSF_CLASS_SIZE_MIN \
+		? TLSF_CLASS_SIZE_MIN : tlsf_class_aligned(size))
+
+/*
+** mapping_search rounds a size up to the next class, so it lands at or
+** above 2^k once it is within half a second-level step below 2^k. The
+** first-level index counts the levels from TLSF_CLASS_SMALL up that the
+** rounded size reaches. Exact for sizes below 2^31.
+*/
+#define tlsf_class_level(adjust, k) \
+	((k) >= TLSF_CLASS_FL_SHIFT && (adjust) > ((size_t)1 << (k)) \
+		- (((size_t)1 << (k)) >> (TLSF_CLASS_SL_LOG2 + 1)))
+#define tlsf_class_fl(adjust) ( \
+	tlsf_class_level(adjust, 1) + tlsf_class_level(adjust, 2) \
+	+ tlsf_class_level(adjust, 3) + tlsf_class_level(adjust, 4) \
+	+ tlsf_class_level(adjust, 5) + tlsf_class_level(adjust, 6) \
+	+ tlsf_class_level(adjust, 7) + tlsf_class_level(adjust, 8) \
+	+ tlsf_class_level(adjust, 9) + tlsf_class_level(adjust, 10) \
+	+ tlsf_class_level(adjust, 11) + tlsf_class_level(adjust, 12) \
+	+ tlsf_class_level(adjust, 13) + tlsf_class_level(adjust, 14) \
+	+ tlsf_class_level(adjust, 15) + tlsf_class_level(adjust, 16) \
+	+ tlsf_class_level(adjust, 17) + tlsf_class_level(adjust, 18) \
+	+ tlsf_class_level(adjust, 19) + tlsf_class_level(adjust, 20) \
+	+ tlsf_class_level(adjust, 21) + tlsf_class_level(adjust, 22) \
+	+ tlsf_class_level(adjust, 23) + tlsf_class_level(adjust, 24) \
+	+ tlsf_class_level(adjust, 25) + tlsf_class_level(adjust, 26) \
+	+ tlsf_class_level(adjust, 27) + tlsf_class_level(adjust, 28) \
+	+ tlsf_class_level(adjust, 29) + tlsf_class_level(adjust, 30) \
+	+ tlsf_class_level(adjust, 31))
+
+/* The second-level index is the size in steps of the level, rounded up. */
+#define tlsf_class_step_log2(fl) ((fl) + TLSF_CLASS_ALIGN_LOG2 - 1)
+#define tlsf_class_sl(adjust, fl) \
+	((fl) ? (int)((((adjust) + ((size_t)1 << tlsf_class_step_log2(fl)) - 1) \
+			>> tlsf_class_step_log2(fl)) & (TLSF_CLASS_SL_COUNT - 1)) \
+		: (int)((adjust) / TLSF_CLASS_ALIGN))
+
+/* First- and second-level class of a request, as mapping_search. */
+#define TLSF_CLASS_FL(size) tlsf_class_fl(TLSF_CLASS_ADJUST(size))
+#define TLSF_CLASS_SL(size) tlsf_class_sl(TLSF_CLASS_ADJUST(size), TLSF_CLASS_FL(size))
+
+#define TLSF_MALLOC_FIXED(tlsf, size) \
+	tlsf_malloc_class((tlsf), TLSF_CLASS_ADJUST(size), \
+		TLSF_CLASS_FL(size), TLSF_CLASS_SL(size))
+
+#if defined (__cplusplus)
+template <size_t N>
+inline void* tlsf_malloc_fixed(tlsf_t tlsf)
+{
+	enum
+	{
+		fl = TLSF_CLASS_FL(N),
+		sl = TLSF_CLASS_SL(N)
+	};
+	static_assert(N > 0, "tlsf_malloc_fixed needs a nonzero size");
+	return tlsf_malloc_class(tlsf, TLSF_CLASS_ADJUST(N), fl, sl);
+}
+#endif
+
+#endif
@@ -0,0 +1,291 @@
+/*
+** malloc replacement built on TLSF, for use with LD_PRELOAD.
+**
+** Build as a shared library alongside tlsf.c, for example:
+**
+**	cc -O2 -shared -fPIC -o libtlsf_preload.so tlsf_preload.c tlsf.c -lpthread
+**	LD_PRELOAD=./libtlsf_preload.so some_program
+**
+** The heap grows by mapping pools of at least PRELOAD_POOL_SIZE bytes
+** with mmap; requests too large for a pool get a pool of their own. The
+** control structure is mapped on first use, sized by tlsf_size() for the
+** features tlsf.c was built with, so allocations made while the dynamic
+** loader is still starting up need nothing from libc but mmap. One
+** mutex serializes all heap access and is held across fork, so the child
+** starts with a consistent heap.
+**
+** Only POSIX systems are supported.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tlsf.h"
+
+#if defined (__GNUC__)
+#define preload_export __attribute__((visibility("default")))
+#else
+#define preload_export
+#endif
+
+/* Minimum size of each pool mapped from the system; may be defined. */
+#if !defined (TLSF_PRELOAD_POOL_SIZE)
+#define TLSF_PRELOAD_POOL_SIZE (64 * 1024 * 1024)
+#endif
+
+enum preload_constants
+{
+	PRELOAD_POOL_SIZE = TLSF_PRELOAD_POOL_SIZE,
+};
+
+static tlsf_t preload_heap;
+static pthread_mutex_t preload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t preload_page_size(void)
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void preload_lock(void)
+{
+	pthread_mutex_lock(&preload_mutex);
+}
+
+static void preload_unlock(void)
+{
+	pthread_mutex_unlock(&preload_mutex);
+}
+
+/*
+** Called with the lock held; must not allocate. Without a heap every
+** later request would fail, so a failure here aborts the process.
+*/
+static void preload_init(void)
+{
+	static const char message[] = "tlsf_preload: cannot map the heap control structure\n";
+	const size_t page = preload_page_size();
+	const size_t size = (tlsf_size() + page - 1) & ~(page - 1);
+	void* mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem != MAP_FAILED)
+	{
+		preload_heap = tlsf_create(mem);
+	}
+	if (!preload_heap)
+	{
+		/*
+		** The result is ignored: there is nowhere else to report to. The
+		** negation keeps glibc's warn_unused_result quiet, which a bare
+		** cast to void does not.
+		*/
+		(void)!write(STDERR_FILENO, message, sizeof(message) - 1);
+		abort();
+	}
+}
+
+/*
+** Fork handlers are registered once the library is loaded rather than
+** from preload_init, since pthread_atfork may itself allocate.
+*/
+#if defined (__GNUC__)
+__attribute__((constructor))
+#endif
+static void preload_register_fork_handlers(void)
+{
+	pthread_atfork(preload_lock, preload_unlock, preload_unlock);
+}
+
+/*
+** Map a new pool large enough for a request of bytes; lock must be held.
+** Searches round requests up to the next size class, so the pool gets an
+** eighth more than asked, which covers every TLSF_SL_INDEX_COUNT_LOG2.
+*/
+static int preload_grow(size_t bytes)
+{
+	const size_t page = preload_page_size();
+	size_t size = bytes + bytes / 8 + tlsf_pool_overhead() + tlsf_alloc_overhead();
+	void* mem;
+
+	if (size < bytes || size > tlsf_block_size_max())
+	{
+		return 0;
+	}
+	size = size < PRELOAD_POOL_SIZE ? PRELOAD_POOL_SIZE : (size + page - 1) & ~(page - 1);
+
+	mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+	{
+		return 0;
+	}
+	if (!tlsf_add_pool(preload_heap, mem, size))
+	{
+		munmap(mem, size);
+		return 0;
+	}
+	return 1;
+}
+
+static void* preload_memalign(size_t align, size_t bytes)
+{
+	void* p = 0;
+
+	preload_lock();
+	if (!preload_heap)
+	{
+		preload_init();
+	}
+
+	p = align > tlsf_align_size()
+		? tlsf_memalign(preload_heap, align, bytes)
+		: tlsf_malloc(preload_heap, bytes);
+
+	/* Leave room for the alignment gap and its free block header. */
+	if (!p && preload_grow(bytes + (align > tlsf_align_size() ? align + 4 * sizeof(void*) : 0)))
+	{
+		p = align > tlsf_align_size()
+			? tlsf_memalign(preload_heap, align, bytes)
+			: tlsf_malloc(preload_heap, bytes);
+	}
+	preload_unlock();
+
+	if (!p)
+	{
+		errno = ENOMEM;
+	}
+	return p;
+}
+
+preload_export void* malloc(size_t size)
+{
+	/* malloc(0) must return a unique pointer; tlsf_malloc(0) returns null. */
+	return preload_memalign(0, size ? size : 1);
+}
+
+preload_export void free(void* ptr)
+{
+	if (ptr)
+	{
+		preload_lock();
+		tlsf_free(preload_heap, ptr);
+		preload_unlock();
+	}
+}
+
+preload_export void* calloc(size_t count, size_t size)
+{
+	const size_t bytes = count * size;
+	void* p;
+
+	if (size && bytes / size != count)
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+
+	/* Not malloc: compilers may fold malloc and memset into a calloc call. */
+	p = preload_memalign(0, bytes ? bytes : 1);
+	if (p)
+	{
+		memset(p, 0, bytes);
+	}
+	return p;
+}
+
+preload_export void* realloc(void* ptr, size_t size)
+{
+	void* p;
+
+	if (!ptr)
+	{
+		return malloc(size);
+	}
+	if (!size)
+	{
+		free(ptr);
+		return 0;
+	}
+
+	preload_lock();
+	p = tlsf_realloc(preload_heap, ptr, size);
+	preload_unlock();
+
+	/* The heap may be out of pools: grow it and copy by hand. */
+	if (!p)
+	{
+		p = malloc(size);
+		if (p)
+		{
+			const size_t old_size = tlsf_block_size(ptr);
+			memcpy(p, ptr, old_size < size ? old_size : size);
+			free(ptr);
+		}
+	}
+	return p;
+}
+
+preload_export void* reallocarray(void* ptr, size_t count, size_t size)
+{
+	if (size && (count * size) / size != count)
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+	return realloc(ptr, count * size);
+}
+
+preload_export int posix_memalign(void** result, size_t align, size_t size)
+{
+	void* p;
+
+	if (!align || (align & (align - 1)) || (align % sizeof(void*)))
+	{
+		return EINVAL;
+	}
+
+	p = preload_memalign(align, size ? size : 1);
+	if (!p)
+	{
+		return ENOMEM;
+	}
+	*result = p;
+	return 0;
+}
+
+preload_export void* aligned_alloc(size_t align, size_t size)
+{
+	if (!align || (align & (align - 1)))
+	{
+		errno = EINVAL;
+		return 0;
+	}
+	return preload_memalign(align, size ? size : 1);
+}
+
+preload_export void* memalign(size_t align, size_t size)
+{
+	return aligned_alloc(align, size);
+}
+
+preload_export void* valloc(size_t size)
+{
+	return preload_memalign(preload_page_size(), size ? size : 1);
+}
+
+preload_export void* pvalloc(size_t size)
+{
+	const size_t page = preload_page_size();
+	return preload_memalign(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+preload_export size_t malloc_usable_size(void* ptr)
+{
+	return tlsf_block_size(ptr);
+}
@@ -0,0 +1,684 @@
+/*
+** Replay of a recorded allocation trace, reporting time, footprint and
+** fragmentation.
+**
+** Build alongside tlsf.c with the configuration to be measured:
+**
+**	cc -O2 -o tlsf_replay tlsf_replay.c tlsf.c -lpthread
+**	tlsf_replay [-c chunk_bytes]... [-n repeats] trace
+**
+** A trace is text with one request per line; ids name blocks, and the
+** addresses of a recorded run will do (decimal, or hexadecimal with 0x).
+** Blank lines and lines starting with # are skipped.
+**
+**	a <id> <size>			malloc
+**	m <id> <align> <size>	memalign
+**	r <id> <size>			realloc; size 0 frees
+**	f <id>					free
+**
+** The heap starts without pools and, like tlsf_preload.c, adds one of at
+** least the chunk size (default 1 MiB) whenever a request fails. Each -c
+** adds a chunk size to try; for each one a line is printed:
+**
+**	sl=32 align=8 chunk=1048576 ops=... ns_per_op=... peak_live=...
+**	peak_footprint=... overhead=... frag=... failed=...
+**
+** peak_live is the most requested bytes live at once and peak_footprint
+** the control structure plus every pool added; overhead is one less their
+** ratio. frag is one less the ratio of the largest free block to all free
+** bytes, taken at the point of peak_live. Blocks are not written to, so
+** the time is the allocator's own; it is the lowest of the repeats
+** (default 3).
+**
+** Size-class subdivision is fixed when tlsf.c is built, so settings are
+** compared by building once per value and running the builds side by
+** side. With -p, the result lines of such runs are read back and the ones
+** no other line beats on time, footprint and fragmentation all at once
+** are printed:
+**
+**	for sl in 3 4 5; do
+**		cc -O2 -DTLSF_SL_INDEX_COUNT_LOG2=$sl -o tlsf_replay_$sl tlsf_replay.c tlsf.c -lpthread
+**		./tlsf_replay_$sl -c 65536 -c 1048576 -c 16777216 trace > replay_$sl.txt &
+**	done
+**	wait
+**	./tlsf_replay_5 -p replay_*.txt
+**
+** Alignment is fixed at the word size by the block layout and is reported
+** but not varied.
+*/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tlsf.h"
+
+enum replay_constants
+{
+	REPLAY_CHUNK_SIZE = 1024 * 1024,
+	REPLAY_CHUNKS_MAX = 32,
+	REPLAY_REPEATS = 3,
+	REPLAY_RESULTS_MAX = 1024,
+};
+
+typedef struct replay_op_t
+{
+	char code;
+	unsigned int slot;
+	size_t align;
+	size_t size;
+} replay_op_t;
+
+/*
+** A loaded trace. Ids are mapped to slots, which are reused once their
+** block is freed, so the replay needs as many slots as blocks live at once.
+*/
+typedef struct replay_trace_t
+{
+	replay_op_t* ops;
+	size_t count;
+	size_t capacity;
+	unsigned int slots;
+} replay_trace_t;
+
+/* Ids of live blocks, chained by slot from a bucket of their hash. */
+typedef struct replay_map_t
+{
+	unsigned long* ids;
+	int* next;
+	char* live;
+	unsigned int capacity;
+	int* buckets;
+	unsigned int bucket_count;
+	unsigned int* free_slots;
+	unsigned int free_count;
+	unsigned int used;
+} replay_map_t;
+
+typedef struct replay_pool_t
+{
+	void* mem;
+	pool_t pool;
+} replay_pool_t;
+
+typedef struct replay_heap_t
+{
+	tlsf_t tlsf;
+	replay_pool_t* pools;
+	size_t pool_count;
+	size_t pool_capacity;
+	size_t chunk;
+	size_t footprint;
+} replay_heap_t;
+
+typedef struct replay_result_t
+{
+	double ns;
+	size_t peak_live;
+	size_t peak_op;
+	size_t footprint;
+	double frag;
+	unsigned long failed;
+} replay_result_t;
+
+static unsigned int replay_hash(const replay_map_t* map, unsigned long id)
+{
+	/* Addresses differ mostly above their alignment bits. */
+	return (unsigned int)((id >> 4) * 2654435761UL) & (map->bucket_count - 1);
+}
+
+/* Double the buckets and rechain the live ids. */
+static int replay_map_rehash(replay_map_t* map)
+{
+	const unsigned int count = map->bucket_count ? map->bucket_count * 2 : 1024;
+	int* buckets = (int*)malloc(count * sizeof(int));
+	unsigned int i;
+
+	if (!buckets)
+	{
+		return 0;
+	}
+	free(map->buckets);
+	map->buckets = buckets;
+	map->bucket_count = count;
+	for (i = 0; i < count; ++i)
+	{
+		buckets[i] = -1;
+	}
+	for (i = 0; i < map->capacity; ++i)
+	{
+		if (map->live[i])
+		{
+			const unsigned int h = replay_hash(map, map->ids[i]);
+			map->next[i] = buckets[h];
+			buckets[h] = (int)i;
+		}
+	}
+	return 1;
+}
+
+/* The slot of a live id, or -1. */
+static int replay_map_find(const replay_map_t* map, unsigned long id)
+{
+	int slot = map->bucket_count ? map->buckets[replay_hash(map, id)] : -1;
+	while (slot >= 0 && map->ids[slot] != id)
+	{
+		slot = map->next[slot];
+	}
+	return slot;
+}
+
+/* Give a new id a slot; returns -1 when out of memory. */
+static int replay_map_add(replay_map_t* map, unsigned long id)
+{
+	unsigned int slot, h;
+
+	if (map->free_count)
+	{
+		slot = map->free_slots[--map->free_count];
+	}
+	else
+	{
+		if (map->used == map->capacity)
+		{
+			const unsigned int capacity = map->capacity ? map->capacity * 2 : 1024;
+			unsigned long* ids = (unsigned long*)realloc(map->ids, capacity * sizeof(unsigned long));
+			int* next;
+			char* live;
+			unsigned int* free_slots;
+
+			if (ids)
+			{
+				map->ids = ids;
+			}
+			next = (int*)realloc(map->next, capacity * sizeof(int));
+			if (next)
+			{
+				map->next = next;
+			}
+			live = (char*)realloc(map->live, capacity);
+			if (live)
+			{
+				map->live = live;
+			}
+			free_slots = (unsigned int*)realloc(map->free_slots, capacity * sizeof(unsigned int));
+			if (free_slots)
+			{
+				map->free_slots = free_slots;
+			}
+			if (!ids || !next || !live || !free_slots)
+			{
+				return -1;
+			}
+			memset(map->live + map->capacity, 0, capacity - map->capacity);
+			map->capacity = capacity;
+		}
+		slot = map->used++;
+	}
+	if (map->used - map->free_count > map->bucket_count && !replay_map_rehash(map))
+	{
+		return -1;
+	}
+
+	h = replay_hash(map, id);
+	map->ids[slot] = id;
+	map->live[slot] = 1;
+	map->next[slot] = map->buckets[h];
+	map->buckets[h] = (int)slot;
+	return (int)slot;
+}
+
+static void replay_map_remove(replay_map_t* map, int slot)
+{
+	int* link = &map->buckets[replay_hash(map, map->ids[slot])];
+	while (*link != slot)
+	{
+		link = &map->next[*link];
+	}
+	*link = map->next[slot];
+	map->live[slot] = 0;
+	map->free_slots[map->free_count++] = (unsigned int)slot;
+}
+
+static void replay_map_destroy(replay_map_t* map)
+{
+	free(map->ids);
+	free(map->next);
+	free(map->live);
+	free(map->buckets);
+	free(map->free_slots);
+}
+
+static int replay_push(replay_trace_t* trace, char code, int slot, size_t align, size_t size)
+{
+	replay_op_t* op;
+
+	if (trace->count == trace->capacity)
+	{
+		const size_t capacity = trace->capacity ? trace->capacity * 2 : 4096;
+		replay_op_t* ops = (replay_op_t*)realloc(trace->ops, capacity * sizeof(replay_op_t));
+		if (!ops)
+		{
+			return 0;
+		}
+		trace->ops = ops;
+		trace->capacity = capacity;
+	}
+	op = &trace->ops[trace->count++];
+	op->code = code;
+	op->slot = (unsigned int)slot;
+	op->align = align;
+	op->size = size;
+	return 1;
+}
+
+/* Read a trace; returns 0 after printing the first problem. */
+static int replay_load(const char* path, replay_trace_t* trace)
+{
+	FILE* file = fopen(path, "r");
+	replay_map_t map;
+	char line[256];
+	unsigned long number = 0;
+	int ok = 1;
+
+	memset(&map, 0, sizeof(map));
+	if (!file)
+	{
+		printf("tlsf_replay: cannot read trace %s\n", path);
+		return 0;
+	}
+
+	while (ok && fgets(line, sizeof(line), file))
+	{
+		char code, id_text[64];
+		unsigned long id, a = 0, b = 0;
+		const int fields = sscanf(line, " %c %63s %lu %lu", &code, id_text, &a, &b);
+		int slot;
+
+		++number;
+		if (fields < 1 || code == '#')
+		{
+			continue;
+		}
+		id = strtoul(id_text, 0, 0);
+		slot = fields >= 2 ? replay_map_find(&map, id) : -1;
+
+		if ((code == 'a' && fields >= 3) || (code == 'm' && fields >= 4))
+		{
+			const size_t align = code == 'm' ? a : 0;
+			const size_t size = code == 'm' ? b : a;
+			if (slot >= 0 || (align & (align - 1)))
+			{
+				ok = 0;
+			}
+			else
+			{
+				/* malloc(0) must return a block; tlsf_malloc(0) does not. */
+				slot = replay_map_add(&map, id);
+				ok = slot >= 0 && replay_push(trace, code, slot, align, size ? size : 1);
+			}
+		}
+		else if (code == 'r' && fields >= 3)
+		{
+			if (slot < 0)
+			{
+				ok = 0;
+			}
+			else if (a)
+			{
+				ok = replay_push(trace, 'r', slot, 0, a);
+			}
+			else
+			{
+				ok = replay_push(trace, 'f', slot, 0, 0);
+				replay_map_remove(&map, slot);
+			}
+		}
+		else if (code == 'f' && fields >= 2 && slot >= 0)
+		{
+			ok = replay_push(trace, 'f', slot, 0, 0);
+			replay_map_remove(&map, slot);
+		}
+		else
+		{
+			ok = 0;
+		}
+	}
+
+	if (!ok)
+	{
+		printf("tlsf_replay: %s:%lu: bad request, unknown id or out of memory\n", path, number);
+	}
+	trace->slots = map.used;
+	replay_map_destroy(&map);
+	fclose(file);
+	return ok;
+}
+
+/*
+** Add a pool large enough for a request of bytes. Searches round requests
+** up to the next size class, so the pool gets an eighth more than asked.
+*/
+static int replay_grow(replay_heap_t* heap, size_t bytes)
+{
+	size_t size = bytes + bytes / 8 + tlsf_pool_overhead() + tlsf_alloc_overhead();
+	void* mem;
+	pool_t pool;
+
+	size = size < heap->chunk ? heap->chunk : size;
+	size = (size + tlsf_align_size() - 1) & ~(tlsf_align_size() - 1);
+	if (size < bytes || size - tlsf_pool_overhead() > tlsf_block_size_max())
+	{
+		return 0;
+	}
+
+	if (heap->pool_count == heap->pool_capacity)
+	{
+		const size_t capacity = heap->pool_capacity ? heap->pool_capacity * 2 : 16;
+		replay_pool_t* pools = (replay_pool_t*)realloc(heap->pools, capacity * sizeof(replay_pool_t));
+		if (!pools)
+		{
+			return 0;
+		}
+		heap->pools = pools;
+		heap->pool_capacity = capacity;
+	}
+
+	mem = malloc(size);
+	pool = mem ? tlsf_add_pool(heap->tlsf, mem, size) : 0;
+	if (!pool)
+	{
+		free(mem);
+		return 0;
+	}
+	heap->pools[heap->pool_count].mem = mem;
+	heap->pools[heap->pool_count].pool = pool;
+	++heap->pool_count;
+	heap->footprint += size;
+	return 1;
+}
+
+static void* replay_alloc(replay_heap_t* heap, size_t align, size_t size)
+{
+	void* p = align > tlsf_align_size()
+		? tlsf_memalign(heap->tlsf, align, size)
+		: tlsf_malloc(heap->tlsf, size);
+
+	/* Leave room for the alignment gap and its free block header. */
+	if (!p && replay_grow(heap, size + (align > tlsf_align_size() ? align + 4 * sizeof(void*) : 0)))
+	{
+		p = align > tlsf_align_size()
+			? tlsf_memalign(heap->tlsf, align, size)
+			: tlsf_malloc(heap->tlsf, size);
+	}
+	return p;
+}
+
+static void replay_walker(void* ptr, size_t size, int used, void* user)
+{
+	size_t* free_bytes = (size_t*)user;
+	(void)ptr;
+	if (!used)
+	{
+		free_bytes[0] += size;
+		free_bytes[1] = size > free_bytes[1] ? size : free_bytes[1];
+	}
+}
+
+static double replay_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+/*
+** Replay the first limit requests on a fresh heap. With walk set, the
+** pools are then walked for result->frag; otherwise the time, peaks and
+** failures are recorded.
+*/
+static int replay_run(const replay_trace_t* trace, size_t chunk, size_t limit, int walk,
+	replay_result_t* result)
+{
+	void** blocks = (void**)calloc(trace->slots + 1, sizeof(void*));
+	size_t* sizes = (size_t*)calloc(trace->slots + 1, sizeof(size_t));
+	replay_heap_t heap;
+	size_t live = 0, i;
+	double start;
+
+	memset(&heap, 0, sizeof(heap));
+	heap.chunk = chunk;
+	heap.footprint = tlsf_size();
+	heap.tlsf = blocks && sizes ? tlsf_create(malloc(tlsf_size())) : 0;
+	if (!heap.tlsf)
+	{
+		free(blocks);
+		free(sizes);
+		return 0;
+	}
+	if (!walk)
+	{
+		result->peak_live = 0;
+		result->peak_op = 0;
+		result->failed = 0;
+	}
+
+	start = replay_clock();
+	for (i = 0; i < limit; ++i)
+	{
+		const replay_op_t* op = &trace->ops[i];
+		void** block = &blocks[op->slot];
+		void* p;
+
+		switch (op->code)
+		{
+		case 'a':
+		case 'm':
+			p = replay_alloc(&heap, op->align, op->size);
+			break;
+		case 'r':
+			/* A block whose allocation failed is allocated afresh. */
+			p = tlsf_realloc(heap.tlsf, *block, op->size);
+			if (!p && replay_grow(&heap, op->size))
+			{
+				p = tlsf_realloc(heap.tlsf, *block, op->size);
+			}
+			break;
+		default:
+			tlsf_free(heap.tlsf, *block);
+			p = 0;
+			break;
+		}
+
+		if (p || op->code == 'f')
+		{
+			live += op->size - sizes[op->slot];
+			sizes[op->slot] = op->size;
+			*block = p;
+		}
+		else if (!walk)
+		{
+			++result->failed;
+		}
+		if (!walk && live > result->peak_live)
+		{
+			result->peak_live = live;
+			result->peak_op = i + 1;
+		}
+	}
+
+	if (walk)
+	{
+		size_t free_bytes[2] = { 0, 0 };
+		for (i = 0; i < heap.pool_count; ++i)
+		{
+			tlsf_walk_pool(heap.pools[i].pool, replay_walker, free_bytes);
+		}
+		result->frag = free_bytes[0] ? 1.0 - (double)free_bytes[1] / (double)free_bytes[0] : 0.0;
+	}
+	else
+	{
+		const double ns = (replay_clock() - start) / (double)(limit ? limit : 1);
+		result->ns = result->ns > 0 && result->ns < ns ? result->ns : ns;
+		result->footprint = heap.footprint;
+	}
+
+	tlsf_destroy(heap.tlsf);
+	free(heap.tlsf);
+	for (i = 0; i < heap.pool_count; ++i)
+	{
+		free(heap.pools[i].mem);
+	}
+	free(heap.pools);
+	free(blocks);
+	free(sizes);
+	return 1;
+}
+
+static void replay_print(const replay_trace_t* trace, size_t chunk, const replay_result_t* result)
+{
+	printf("sl=%lu align=%lu chunk=%lu ops=%lu ns_per_op=%.1f peak_live=%lu peak_footprint=%lu"
+		" overhead=%.3f frag=%.3f failed=%lu\n",
+		(unsigned long)tlsf_sl_index_count(), (unsigned long)tlsf_align_size(),
+		(unsigned long)chunk, (unsigned long)trace->count, result->ns,
+		(unsigned long)result->peak_live, (unsigned long)result->footprint,
+		result->footprint ? 1.0 - (double)result->peak_live / (double)result->footprint : 0.0,
+		result->frag, result->failed);
+}
+
+typedef struct replay_line_t
+{
+	char text[256];
+	double ns;
+	double footprint;
+	double frag;
+} replay_line_t;
+
+/* Whether a is no worse than b on every measure and better on one. */
+static int replay_dominates(const replay_line_t* a, const replay_line_t* b)
+{
+	return a->ns <= b->ns && a->footprint <= b->footprint && a->frag <= b->frag
+		&& (a->ns < b->ns || a->footprint < b->footprint || a->frag < b->frag);
+}
+
+/* Print the result lines of the files that no other line dominates. */
+static int replay_pareto(int count, char** paths)
+{
+	static replay_line_t lines[REPLAY_RESULTS_MAX];
+	int line_count = 0, i, j;
+
+	for (i = 0; i < count; ++i)
+	{
+		FILE* file = fopen(paths[i], "r");
+		if (!file)
+		{
+			printf("tlsf_replay: cannot read results %s\n", paths[i]);
+			return 2;
+		}
+		while (line_count < REPLAY_RESULTS_MAX
+			&& fgets(lines[line_count].text, sizeof(lines[line_count].text), file))
+		{
+			replay_line_t* line = &lines[line_count];
+			const char* ns = strstr(line->text, " ns_per_op=");
+			const char* footprint = strstr(line->text, " peak_footprint=");
+			const char* frag = strstr(line->text, " frag=");
+			if (ns && footprint && frag)
+			{
+				line->ns = atof(ns + 11);
+				line->footprint = atof(footprint + 16);
+				line->frag = atof(frag + 6);
+				++line_count;
+			}
+		}
+		fclose(file);
+	}
+
+	for (i = 0; i < line_count; ++i)
+	{
+		for (j = 0; j < line_count && !replay_dominates(&lines[j], &lines[i]); ++j)
+		{
+		}
+		if (j == line_count)
+		{
+			fputs(lines[i].text, stdout);
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	size_t chunks[REPLAY_CHUNKS_MAX];
+	int chunk_count = 0, repeats = REPLAY_REPEATS;
+	const char* path = 0;
+	replay_trace_t trace;
+	int i, c, repeat;
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+		{
+			return replay_pareto(argc - i - 1, argv + i + 1);
+		}
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && chunk_count < REPLAY_CHUNKS_MAX)
+		{
+			chunks[chunk_count++] = (size_t)strtoul(argv[++i], 0, 0);
+		}
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+		{
+			repeats = atoi(argv[++i]);
+		}
+		else if (argv[i][0] != '-' && !path)
+		{
+			path = argv[i];
+		}
+		else
+		{
+			path = 0;
+			break;
+		}
+	}
+	if (!path || repeats < 1)
+	{
+		printf("usage: %s [-c chunk_bytes]... [-n repeats] trace\n"
+			"       %s -p results...\n", argv[0], argv[0]);
+		return 2;
+	}
+	if (!chunk_count)
+	{
+		chunks[chunk_count++] = REPLAY_CHUNK_SIZE;
+	}
+
+	memset(&trace, 0, sizeof(trace));
+	if (!replay_load(path, &trace))
+	{
+		free(trace.ops);
+		return 2;
+	}
+
+	for (c = 0; c < chunk_count; ++c)
+	{
+		replay_result_t result;
+		int ok = 1;
+
+		memset(&result, 0, sizeof(result));
+		for (repeat = 0; ok && repeat < repeats; ++repeat)
+		{
+			ok = replay_run(&trace, chunks[c], trace.count, 0, &result);
+		}
+		if (!ok || !replay_run(&trace, chunks[c], result.peak_op, 1, &result))
+		{
+			printf("tlsf_replay: out of memory\n");
+			free(trace.ops);
+			return 2;
+		}
+		replay_print(&trace, chunks[c], &result);
+		fflush(stdout);
+	}
+
+	free(trace.ops);
+	return 0;
+}
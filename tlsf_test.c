@@ -0,0 +1,795 @@
+/*
+** Self-checks for tlsf.c.
+**
+** Build alongside tlsf.c with the feature macros to be checked, then run;
+** the exit status is nonzero if any check failed. For example:
+**
+**	cc -O2 -o tlsf_test tlsf_test.c tlsf.c -lpthread && ./tlsf_test
+**	cc -O2 -DTLSF_MMAP -o tlsf_test tlsf_test.c tlsf.c -lpthread && ./tlsf_test
+**
+** Checks that need a feature the build lacks are skipped.
+*/
+
+#if defined (TLSF_SHARED) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined (TLSF_SHARED)
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "tlsf.h"
+#include "tlsf_inline.h"
+
+enum test_constants
+{
+	TEST_POOL_SIZE = 4 * 1024 * 1024,
+};
+
+static int test_failures;
+
+#define test_check(condition) \
+	((condition) ? (void)0 : test_fail(__FILE__, __LINE__, #condition))
+
+static void test_fail(const char* file, int line, const char* condition)
+{
+	printf("%s:%d: check failed: %s\n", file, line, condition);
+	++test_failures;
+}
+
+/* Create a heap with one pool of TEST_POOL_SIZE bytes, all from malloc. */
+static tlsf_t test_heap_create(void)
+{
+	tlsf_t tlsf = tlsf_create_with_pool(malloc(tlsf_size() + TEST_POOL_SIZE),
+		tlsf_size() + TEST_POOL_SIZE);
+	test_check(tlsf != 0);
+	return tlsf;
+}
+
+static void test_heap_destroy(tlsf_t tlsf)
+{
+	test_check(tlsf_check(tlsf) == 0);
+	tlsf_destroy(tlsf);
+	free(tlsf);
+}
+
+/* Region requests whose size or alignment would wrap must fail. */
+static void test_region_overflow(void)
+{
+	const size_t size_max = ~(size_t)0;
+	tlsf_t tlsf = test_heap_create();
+	tlsf_region_t region = tlsf_region_create(tlsf, 4096);
+	size_t shift;
+
+	test_check(region != 0);
+	test_check(tlsf_region_malloc(region, size_max) == 0);
+	test_check(tlsf_region_malloc(region, size_max - 1) == 0);
+	test_check(tlsf_region_malloc(region, size_max - tlsf_align_size()) == 0);
+	test_check(tlsf_region_malloc(region, size_max - 2 * tlsf_align_size()) == 0);
+	for (shift = 4; shift < sizeof(size_t) * 8; ++shift)
+	{
+		const size_t align = (size_t)1 << shift;
+		test_check(tlsf_region_memalign(region, align, size_max - align) == 0);
+		if (align <= 4096)
+		{
+			test_check(tlsf_region_memalign(region, align, 16) != 0);
+		}
+	}
+
+	/* The region still works after the failed requests. */
+	test_check(tlsf_region_malloc(region, 100) != 0);
+	tlsf_region_destroy(region);
+	test_heap_destroy(tlsf);
+}
+
+/*
+** Short-lived blocks of every size come from the high end of free space,
+** apart from long-lived ones, which come from the low end.
+*/
+static void test_short_placement(void)
+{
+	size_t sizes[] = { 1, 8, 16, 24, 31, 32, 33, 48, 100, 1000, 50000, 0 };
+	tlsf_t tlsf = test_heap_create();
+	char* low = (char*)tlsf_malloc_hint(tlsf, 64, TLSF_LIFETIME_LONG);
+	char* blocks[sizeof(sizes) / sizeof(sizes[0])];
+	size_t i;
+
+	sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] = tlsf_block_size_min();
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		char* longer = (char*)tlsf_malloc_hint(tlsf, sizes[i], TLSF_LIFETIME_LONG);
+		blocks[i] = (char*)tlsf_malloc_hint(tlsf, sizes[i], TLSF_LIFETIME_SHORT);
+		test_check(blocks[i] != 0 && tlsf_block_size(blocks[i]) >= sizes[i]);
+		test_check(blocks[i] > low + TEST_POOL_SIZE / 2);
+		test_check(longer > low && longer < low + TEST_POOL_SIZE / 2);
+		test_check(i == 0 || blocks[i] < blocks[i - 1]);
+		tlsf_free(tlsf, longer);
+	}
+	test_check(tlsf_check(tlsf) == 0);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+	{
+		tlsf_free(tlsf, blocks[i]);
+	}
+	tlsf_free(tlsf, low);
+	test_heap_destroy(tlsf);
+}
+
+/*
+** Blocks from precomputed classes match tlsf_malloc's, and class
+** arguments that do not fit the size still give a large enough block.
+*/
+static void test_malloc_class(void)
+{
+	tlsf_t tlsf = test_heap_create();
+	size_t size;
+	void* p;
+
+	for (size = 1; size < 1024 * 1024; size += size < 4096 ? 1 : size / 7)
+	{
+		void* fixed = TLSF_MALLOC_FIXED(tlsf, size);
+		void* plain = tlsf_malloc(tlsf, size);
+		test_check(fixed != 0 && plain != 0);
+		test_check(tlsf_block_size(fixed) >= size);
+		test_check(tlsf_block_size(fixed) == tlsf_block_size(plain));
+		tlsf_free(tlsf, fixed);
+		tlsf_free(tlsf, plain);
+	}
+
+	p = TLSF_MALLOC_FIXED(tlsf, 100);
+	test_check(p != 0 && tlsf_block_size(p) >= 100);
+	tlsf_free(tlsf, p);
+
+	/* Negative, too low a class, and an unadjusted size. */
+	p = tlsf_malloc_class(tlsf, 64, -1, 0);
+	test_check(p != 0 && tlsf_block_size(p) >= 64);
+	tlsf_free(tlsf, p);
+	p = tlsf_malloc_class(tlsf, 64, 0, -1);
+	test_check(p != 0 && tlsf_block_size(p) >= 64);
+	tlsf_free(tlsf, p);
+	p = tlsf_malloc_class(tlsf, 4096, 0, 1);
+	test_check(p != 0 && tlsf_block_size(p) >= 4096);
+	tlsf_free(tlsf, p);
+	p = tlsf_malloc_class(tlsf, 4096, TLSF_CLASS_FL(4096) - 1, TLSF_CLASS_SL_COUNT - 1);
+	test_check(p != 0 && tlsf_block_size(p) >= 4096);
+	tlsf_free(tlsf, p);
+	p = tlsf_malloc_class(tlsf, 4097, TLSF_CLASS_FL(4096), TLSF_CLASS_SL(4096));
+	test_check(p != 0 && tlsf_block_size(p) >= 4097);
+	tlsf_free(tlsf, p);
+	test_heap_destroy(tlsf);
+}
+
+#if defined (TLSF_DEFER_COALESCE)
+/* Fill a heap with blocks of size bytes; returns how many fit. */
+static int test_fill(tlsf_t tlsf, void** blocks, int capacity, size_t size)
+{
+	int count = 0;
+	while (count < capacity && (blocks[count] = tlsf_malloc(tlsf, size)) != 0)
+	{
+		++count;
+	}
+	return count;
+}
+
+/*
+** Small frees wait on the deferred lists, up to a limit past which they
+** are coalesced at once. Requests of their class take them back, larger
+** requests coalesce them, and pools holding them can be checked and
+** removed.
+*/
+static void test_deferred_frees(void)
+{
+	const size_t bytes = 64 * 1024;
+	char* mem = (char*)malloc(tlsf_size() + bytes);
+	tlsf_t tlsf = tlsf_create_with_pool(mem, tlsf_size() + bytes);
+	void* blocks[2048];
+	size_t pending;
+	int count, i;
+	void* p;
+
+	count = test_fill(tlsf, blocks, 2048, 64);
+	test_check(count > 300 && count < 2048);
+	for (i = 0; i < count; ++i)
+	{
+		tlsf_free(tlsf, blocks[i]);
+	}
+	pending = tlsf_coalesce(tlsf, 0);
+	test_check(pending > 0 && pending < (size_t)count);
+	test_check(tlsf_check(tlsf) == 0);
+
+	/* The last block deferred is the first taken back. */
+	p = tlsf_malloc(tlsf, 64);
+	test_check(p == blocks[pending - 1]);
+	test_check(tlsf_coalesce(tlsf, 0) == pending - 1);
+	tlsf_free(tlsf, p);
+	test_check(tlsf_coalesce(tlsf, 0) == pending);
+
+	/* Only the deferred blocks coalesced make room for this. */
+	p = tlsf_malloc(tlsf, (size_t)count * 64);
+	test_check(p != 0);
+	test_check(tlsf_coalesce(tlsf, 0) == 0);
+	tlsf_free(tlsf, p);
+
+	/* Remove the pool while its blocks are pending, then add it again. */
+	test_check(test_fill(tlsf, blocks, 2048, 64) == count);
+	for (i = 0; i < count; ++i)
+	{
+		tlsf_free(tlsf, blocks[i]);
+	}
+	test_check(tlsf_coalesce(tlsf, 0) == pending);
+	test_check(tlsf_check(tlsf) == 0);
+	tlsf_remove_pool(tlsf, tlsf_get_pool(tlsf));
+	test_check(tlsf_coalesce(tlsf, 0) == 0);
+	test_check(tlsf_check(tlsf) == 0);
+	test_check(tlsf_malloc(tlsf, 64) == 0);
+
+	test_check(tlsf_add_pool(tlsf, mem + tlsf_size(), bytes) != 0);
+	p = tlsf_malloc(tlsf, (size_t)count * 64);
+	test_check(p != 0);
+	tlsf_free(tlsf, p);
+	test_heap_destroy(tlsf);
+}
+#else
+#define test_deferred_frees() ((void)0)
+#endif
+
+#if defined (TLSF_TAGS)
+#define test_malloc_tagged(tlsf, size, tag) tlsf_malloc_tagged((tlsf), (size), (tag))
+#else
+#define test_malloc_tagged(tlsf, size, tag) tlsf_malloc((tlsf), (size))
+#endif
+
+/* A pool's blocks by offset from a base, as tlsf_walk_pool reports them. */
+typedef struct test_layout_t
+{
+	const char* base;
+	int count;
+	size_t offset[1024];
+	size_t size[1024];
+	int used[1024];
+} test_layout_t;
+
+static void test_layout_walker(void* ptr, size_t size, int used, void* user)
+{
+	test_layout_t* layout = (test_layout_t*)user;
+	if (layout->count < 1024)
+	{
+		layout->offset[layout->count] = (size_t)((const char*)ptr - layout->base);
+		layout->size[layout->count] = size;
+		layout->used[layout->count] = used;
+	}
+	++layout->count;
+}
+
+/*
+** A copy of a pool attached to a fresh heap has the same blocks, with
+** frees that were still deferred done, and the same contents and tags.
+*/
+static void test_attach_copy(void)
+{
+	const size_t bytes = 256 * 1024;
+	static test_layout_t before, after;
+	char* mem = (char*)malloc(bytes);
+	char* copy = (char*)malloc(bytes);
+	tlsf_t tlsf = tlsf_create(malloc(tlsf_size()));
+	tlsf_t fresh = tlsf_create(malloc(tlsf_size()));
+	pool_t pool = tlsf_add_pool(tlsf, mem, bytes);
+	pool_t attached;
+	char* blocks[300];
+	size_t free_before = 0, free_after = 0;
+	int i;
+
+	for (i = 0; i < 300; ++i)
+	{
+		const size_t size = 16 + (size_t)(i * 37) % 700;
+		blocks[i] = (char*)test_malloc_tagged(tlsf, size, (unsigned int)(i % 5));
+		test_check(blocks[i] != 0);
+		memset(blocks[i], i & 0xff, size);
+	}
+	for (i = 0; i < 300; i += 3)
+	{
+		tlsf_free(tlsf, blocks[i]);
+		blocks[i] = 0;
+	}
+
+	memcpy(copy, mem, bytes);
+	attached = tlsf_attach_pool(fresh, copy, bytes);
+	test_check(attached != 0);
+	test_check(tlsf_check(fresh) == 0);
+
+	/* The original's deferred frees coalesce as the attach did. */
+	tlsf_coalesce(tlsf, ~(size_t)0);
+	before.base = (const char*)pool;
+	after.base = (const char*)attached;
+	tlsf_walk_pool(pool, test_layout_walker, &before);
+	tlsf_walk_pool(attached, test_layout_walker, &after);
+	test_check(before.count == after.count && before.count <= 1024);
+	for (i = 0; i < before.count && i < after.count && i < 1024; ++i)
+	{
+		test_check(before.offset[i] == after.offset[i]);
+		test_check(before.size[i] == after.size[i]);
+		test_check(before.used[i] == after.used[i]);
+		free_before += before.used[i] ? 0 : before.size[i];
+		free_after += after.used[i] ? 0 : after.size[i];
+	}
+	test_check(free_before == free_after && free_after > 0);
+#if defined (TLSF_PRIO)
+	test_check(tlsf_free_bytes(tlsf) == tlsf_free_bytes(fresh));
+#endif
+#if defined (TLSF_TAGS)
+	for (i = 0; i < 5; ++i)
+	{
+		tlsf_tag_stats_t stats_before, stats_after;
+		tlsf_tag_stats(tlsf, (unsigned int)i, &stats_before);
+		tlsf_tag_stats(fresh, (unsigned int)i, &stats_after);
+		test_check(stats_before.bytes == stats_after.bytes);
+		test_check(stats_before.count == stats_after.count);
+	}
+#endif
+
+	/* The copies hold the same data and free back into the fresh heap. */
+	for (i = 0; i < 300; ++i)
+	{
+		if (blocks[i])
+		{
+			char* p = copy + (blocks[i] - mem);
+			test_check(p[0] == (char)(i & 0xff) && tlsf_block_size(p) == tlsf_block_size(blocks[i]));
+			tlsf_free(tlsf, blocks[i]);
+			tlsf_free(fresh, p);
+		}
+	}
+	test_check(tlsf_check(tlsf) == 0);
+	test_check(tlsf_check(fresh) == 0);
+
+	tlsf_remove_pool(tlsf, pool);
+	tlsf_remove_pool(fresh, attached);
+	tlsf_destroy(tlsf);
+	tlsf_destroy(fresh);
+	free(tlsf);
+	free(fresh);
+	free(mem);
+	free(copy);
+}
+
+#if defined (TLSF_POOL_LISTS)
+enum test_pool_constants
+{
+	TEST_POOL_COUNT = 3,
+	TEST_POOL_BYTES = 256 * 1024,
+};
+
+/* The index of the pool memory a block lies in, or -1. */
+static int test_pool_of(char* const* mem, const void* ptr)
+{
+	int i;
+	for (i = 0; i < TEST_POOL_COUNT; ++i)
+	{
+		if ((const char*)ptr >= mem[i] && (const char*)ptr < mem[i] + TEST_POOL_BYTES)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+** Blocks from a chosen pool stay in it and are counted there; plain
+** requests go to a pool with room, PERMANENT ones to the lowest such
+** pool, and none to a draining pool.
+*/
+static void test_pool_lists(void)
+{
+	tlsf_t tlsf = tlsf_create(malloc(tlsf_size()));
+	char* mem[TEST_POOL_COUNT];
+	pool_t pools[TEST_POOL_COUNT];
+	void* fill[TEST_POOL_COUNT];
+	void* p;
+	int i, lowest = 0, highest = 0, middle;
+#if defined (TLSF_STATS)
+	tlsf_stats_t stats;
+#endif
+
+	for (i = 0; i < TEST_POOL_COUNT; ++i)
+	{
+		mem[i] = (char*)malloc(TEST_POOL_BYTES);
+		pools[i] = tlsf_add_pool(tlsf, mem[i], TEST_POOL_BYTES);
+		test_check(pools[i] != 0);
+		lowest = mem[i] < mem[lowest] ? i : lowest;
+		highest = mem[i] > mem[highest] ? i : highest;
+	}
+	middle = TEST_POOL_COUNT - lowest - highest;
+
+	/* Each pool serves its own requests and counts their bytes. */
+	for (i = 0; i < TEST_POOL_COUNT; ++i)
+	{
+		void* aligned = tlsf_memalign_from_pool(tlsf, pools[i], 256, 100);
+		p = tlsf_malloc_from_pool(tlsf, pools[i], 1000);
+		test_check(test_pool_of(mem, p) == i && test_pool_of(mem, aligned) == i);
+		test_check(((size_t)aligned & 255) == 0);
+		test_check(tlsf_pool_used(tlsf, pools[i]) == tlsf_block_size(p) + tlsf_block_size(aligned));
+		test_check(tlsf_malloc_from_pool(tlsf, pools[i], TEST_POOL_BYTES) == 0);
+		tlsf_free(tlsf, p);
+		tlsf_free(tlsf, aligned);
+		test_check(tlsf_pool_used(tlsf, pools[i]) == 0);
+	}
+#if defined (TLSF_STATS)
+	tlsf_stats(tlsf, &stats);
+	test_check(stats.splits >= TEST_POOL_COUNT);
+#endif
+
+	/* PERMANENT blocks take the lowest pool while it has room. */
+	p = tlsf_malloc_hint(tlsf, 1000, TLSF_LIFETIME_PERMANENT);
+	test_check(test_pool_of(mem, p) == lowest);
+	fill[0] = tlsf_malloc_from_pool(tlsf, pools[lowest], TEST_POOL_BYTES - 16 * 1024);
+	test_check(fill[0] != 0);
+	fill[1] = tlsf_malloc_hint(tlsf, 32 * 1024, TLSF_LIFETIME_PERMANENT);
+	test_check(test_pool_of(mem, fill[1]) == middle);
+	tlsf_free(tlsf, fill[1]);
+
+	/* A request only one pool can hold goes there. */
+	fill[1] = tlsf_malloc_from_pool(tlsf, pools[middle], TEST_POOL_BYTES - 16 * 1024);
+	test_check(fill[1] != 0);
+	fill[2] = tlsf_malloc(tlsf, 64 * 1024);
+	test_check(test_pool_of(mem, fill[2]) == highest);
+	tlsf_free(tlsf, fill[2]);
+
+	/* Nothing new is placed in a draining pool. */
+	tlsf_pool_set_draining(tlsf, pools[highest], 1);
+	test_check(tlsf_malloc(tlsf, 64 * 1024) == 0);
+	test_check(tlsf_malloc_from_pool(tlsf, pools[highest], 64) == 0);
+	tlsf_pool_set_draining(tlsf, pools[highest], 0);
+	fill[2] = tlsf_malloc(tlsf, 64 * 1024);
+	test_check(test_pool_of(mem, fill[2]) == highest);
+
+	tlsf_free(tlsf, p);
+	for (i = 0; i < TEST_POOL_COUNT; ++i)
+	{
+		tlsf_free(tlsf, fill[i]);
+	}
+	test_check(tlsf_check(tlsf) == 0);
+	for (i = 0; i < TEST_POOL_COUNT; ++i)
+	{
+		test_check(tlsf_pool_used(tlsf, pools[i]) == 0);
+		tlsf_remove_pool(tlsf, pools[i]);
+		free(mem[i]);
+	}
+	tlsf_destroy(tlsf);
+	free(tlsf);
+}
+#else
+#define test_pool_lists() ((void)0)
+#endif
+
+/* Child heaps stay within their quota through any mix of requests. */
+static void test_child_quota(void)
+{
+	const size_t quota = 20000;
+	tlsf_t tlsf = test_heap_create();
+	tlsf_child_t child = tlsf_child_create(tlsf, 64 * 1024, quota);
+	void* blocks[256];
+	unsigned int state = 3;
+	long i;
+
+	memset(blocks, 0, sizeof(blocks));
+	for (i = 0; i < 100000; ++i)
+	{
+		void** block;
+		state = state * 1103515245 + 12345;
+		block = &blocks[(state >> 8) % 256];
+
+		if (!*block)
+		{
+			*block = tlsf_child_malloc(child, (state >> 16) % 300 + 1);
+		}
+		else if (state & 0x10000)
+		{
+			void* p = tlsf_child_realloc(child, *block, (state >> 17) % 600 + 1);
+			if (p)
+			{
+				*block = p;
+			}
+		}
+		else
+		{
+			tlsf_child_free(child, *block);
+			*block = 0;
+		}
+		test_check(tlsf_child_used(child) <= quota);
+	}
+
+	tlsf_child_destroy(child);
+	test_heap_destroy(tlsf);
+}
+
+#if defined (TLSF_PRIO)
+/* Low priorities stop at their watermark; higher ones may pass it. */
+static void test_prio_watermark(void)
+{
+	tlsf_t tlsf = test_heap_create();
+	const size_t initial = tlsf_free_bytes(tlsf);
+	const size_t watermark = initial / 2;
+	void* blocks[4096];
+	void* critical;
+	int count = 0;
+
+	tlsf_set_prio_watermark(tlsf, TLSF_PRIO_LOW, watermark);
+	while (count < 4096 && (blocks[count] = tlsf_malloc_prio(tlsf, 1000, TLSF_PRIO_LOW)) != 0)
+	{
+		test_check(tlsf_free_bytes(tlsf) >= watermark);
+		++count;
+	}
+	test_check(count > 0 && count < 4096);
+	test_check(tlsf_prio_denied(tlsf, TLSF_PRIO_LOW) == 1);
+	test_check(tlsf_prio_denied(tlsf, TLSF_PRIO_CRITICAL) == 0);
+
+	critical = tlsf_malloc_prio(tlsf, watermark / 2, TLSF_PRIO_CRITICAL);
+	test_check(critical != 0);
+	test_check(tlsf_free_bytes(tlsf) < watermark);
+	test_check(tlsf_check(tlsf) == 0);
+
+	tlsf_free(tlsf, critical);
+	while (count > 0)
+	{
+		tlsf_free(tlsf, blocks[--count]);
+	}
+
+	/* Deferred frees still hold their headers until they coalesce. */
+	tlsf_coalesce(tlsf, ~(size_t)0);
+	test_check(tlsf_free_bytes(tlsf) == initial);
+	test_heap_destroy(tlsf);
+}
+#else
+#define test_prio_watermark() ((void)0)
+#endif
+
+#if defined (TLSF_SHARED)
+/* The largest block the heap can allocate, found by bisection. */
+static size_t test_largest(tlsf_t tlsf)
+{
+	size_t low = 0, high = TEST_POOL_SIZE;
+
+	tlsf_coalesce(tlsf, ~(size_t)0);
+	while (low < high)
+	{
+		const size_t mid = low + (high - low + 1) / 2;
+		void* p = tlsf_malloc(tlsf, mid);
+		if (p)
+		{
+			tlsf_free(tlsf, p);
+			low = mid;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+/*
+** A process killed while it holds a shared heap's lock leaves the next
+** locker to recover: used blocks keep their contents, and once they are
+** freed the heap is whole again. The child reports its blocks through a
+** second shared mapping.
+*/
+static void test_shared_recovery(void)
+{
+	const size_t bytes = TEST_POOL_SIZE / 4;
+	void* mem = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	void** live = (void**)mmap(0, 64 * sizeof(void*), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	tlsf_shared_t shared = mem != MAP_FAILED ? tlsf_shared_create(mem, bytes) : 0;
+	char* kept[16];
+	size_t largest;
+	tlsf_t tlsf;
+	pid_t child;
+	int i, status = 0;
+
+	test_check(shared != 0 && live != MAP_FAILED);
+	if (!shared || live == MAP_FAILED)
+	{
+		return;
+	}
+	memset(live, 0, 64 * sizeof(void*));
+	tlsf = tlsf_shared_lock(shared);
+	largest = test_largest(tlsf);
+	tlsf_shared_unlock(shared);
+	for (i = 0; i < 16; ++i)
+	{
+		kept[i] = (char*)tlsf_shared_malloc(shared, 100 + i);
+		memset(kept[i], i, 100 + i);
+	}
+
+	/*
+	** The child allocates and frees, some frees deferred, then dies with
+	** the lock held between two requests.
+	*/
+	child = fork();
+	if (child == 0)
+	{
+		for (i = 0; i < 63; ++i)
+		{
+			live[i] = tlsf_shared_malloc(shared, 24 + i * 8);
+		}
+		for (i = 0; i < 63; i += 2)
+		{
+			tlsf_shared_free(shared, live[i]);
+			live[i] = 0;
+		}
+		tlsf = tlsf_shared_lock(shared);
+		live[63] = tlsf_malloc(tlsf, 5000);
+		tlsf_free(tlsf, live[1]);
+		live[1] = 0;
+		kill(getpid(), SIGKILL);
+		_exit(0);
+	}
+	test_check(child > 0);
+	waitpid(child, &status, 0);
+	test_check(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+	tlsf = tlsf_shared_lock(shared);
+	test_check(tlsf != 0);
+	if (tlsf)
+	{
+		test_check(tlsf_check(tlsf) == 0);
+		for (i = 0; i < 16; ++i)
+		{
+			test_check(kept[i][0] == i && kept[i][99 + i] == i);
+			tlsf_free(tlsf, kept[i]);
+		}
+		for (i = 0; i < 64; ++i)
+		{
+			tlsf_free(tlsf, live[i]);
+		}
+		test_check(test_largest(tlsf) == largest);
+		test_check(tlsf_check(tlsf) == 0);
+		tlsf_shared_unlock(shared);
+	}
+	munmap(live, 64 * sizeof(void*));
+	munmap(mem, bytes);
+}
+#else
+#define test_shared_recovery() ((void)0)
+#endif
+
+/*
+** Growing a pool block past the largest block either moves it or fails,
+** leaving the block as it was; it never shrinks it in place.
+*/
+static void test_realloc_huge(void)
+{
+	static const size_t shifts[] = { 1, 2, 8 };
+	tlsf_t tlsf = test_heap_create();
+	size_t i;
+
+	for (i = 0; i < sizeof(shifts) / sizeof(shifts[0]); ++i)
+	{
+		const size_t size = ~(size_t)0 / shifts[i];
+		char* q = (char*)tlsf_malloc(tlsf, 1000);
+		char* p;
+
+		memset(q, 0x5a, 1000);
+		p = (char*)tlsf_realloc(tlsf, q, size);
+		test_check(p == 0);
+		test_check(tlsf_block_size(q) >= 1000 && q[999] == 0x5a);
+		tlsf_free(tlsf, q);
+	}
+	test_heap_destroy(tlsf);
+}
+
+#if defined (TLSF_MMAP)
+/* Counts a pool's used blocks. */
+static void test_count_used(void* ptr, size_t size, int used, void* user)
+{
+	(void)ptr;
+	(void)size;
+	*(int*)user += used;
+}
+
+/* Write all of a block's usable size, then free it. */
+static void test_usable(tlsf_t tlsf, void* ptr)
+{
+	if (ptr)
+	{
+		memset(ptr, 0xa5, tlsf_block_size(ptr));
+		tlsf_free(tlsf, ptr);
+	}
+}
+
+/* Mapped blocks must hold the whole request at every alignment. */
+static void test_mapped_sizes(void)
+{
+	const size_t threshold = 64 * 1024;
+	static const size_t offsets[] = { 0, 1, 7, 8, 63, 64, 100, 4000, 4080, 4095, 4096, 4097, 8191 };
+	tlsf_t tlsf = test_heap_create();
+	size_t align, i;
+
+	tlsf_set_mmap_threshold(tlsf, threshold);
+	for (align = tlsf_align_size(); align <= 64 * 1024; align *= 2)
+	{
+		for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i)
+		{
+			const size_t size = threshold + offsets[i];
+			void* p = tlsf_memalign(tlsf, align, size);
+
+			test_check(p != 0 && tlsf_block_size(p) >= size);
+			test_check(((size_t)p & (align - 1)) == 0);
+			test_usable(tlsf, p);
+		}
+	}
+
+	for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i)
+	{
+		const size_t size = threshold + offsets[i];
+		void* p = tlsf_malloc_ex(tlsf, size, TLSF_MALLOC_ISOLATE);
+
+		test_check(p != 0 && tlsf_block_size(p) >= size);
+		test_usable(tlsf, p);
+
+		p = tlsf_malloc(tlsf, size);
+		test_check(p != 0 && tlsf_block_size(p) >= size);
+		test_usable(tlsf, p);
+	}
+
+	/* Pool blocks grown past the threshold move to a mapping. */
+	for (i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i)
+	{
+		const size_t size = threshold + offsets[i];
+		char* q = (char*)tlsf_malloc(tlsf, 1000);
+		char* p;
+		int used = 0;
+
+		memset(q, 0x5a, 1000);
+		p = (char*)tlsf_realloc(tlsf, q, size);
+		test_check(p != 0 && tlsf_block_size(p) >= size);
+		test_check(p != 0 && p[0] == 0x5a && p[999] == 0x5a);
+		tlsf_coalesce(tlsf, ~(size_t)0);
+		tlsf_walk_pool(tlsf_get_pool(tlsf), test_count_used, &used);
+		test_check(used == 0);
+		test_usable(tlsf, p);
+	}
+
+	/* Past the largest pool block, too, if the system can map it. */
+	if (sizeof(size_t) > 4)
+	{
+		const size_t size = (size_t)5 << 30;
+		char* q = (char*)tlsf_malloc(tlsf, 1000);
+		char* p = (char*)tlsf_realloc(tlsf, q, size);
+
+		test_check(p ? tlsf_block_size(p) >= size : tlsf_block_size(q) >= 1000);
+		tlsf_free(tlsf, p ? p : q);
+	}
+	test_heap_destroy(tlsf);
+}
+#else
+#define test_mapped_sizes() ((void)0)
+#endif
+
+int main(void)
+{
+	test_region_overflow();
+	test_child_quota();
+	test_short_placement();
+	test_malloc_class();
+	test_deferred_frees();
+	test_attach_copy();
+	test_pool_lists();
+	test_prio_watermark();
+	test_shared_recovery();
+	test_realloc_huge();
+	test_mapped_sizes();
+
+	if (test_failures)
+	{
+		printf("%d checks failed\n", test_failures);
+		return EXIT_FAILURE;
+	}
+	printf("all checks passed\n");
+	return EXIT_SUCCESS;
+}